@@ -8,12 +8,23 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -24,6 +35,10 @@
 
 #define CTRL_KEY(k) ((k)&0x1f)
 
+#define INPUT_RING 4096
+#define ESC_TIMEOUT 50
+#define PASTE_TIMEOUT 1000
+
 enum editorKey {
     BACKSPACE = 127,
     ARROW_LEFT = 1000,
@@ -34,7 +49,10 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_START,
+    PASTE_END,
+    DISK_CHANGED
 };
 
 enum editorHighlight {
@@ -51,7 +69,66 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
+#define HL_CHECKPOINT 256
+#define HL_LOOKAHEAD 32
+#define HL_CACHE_ROWS 4096
+#define HL_SYNC_LINES 1024
+#define HL_PENDING -1
+#define HL_RESYNC 64
+
+#define ROPE_MAX 32
+
+#define SLAB_SIZE (1 << 20)
+#define SLAB_HEADER 16
+#define SLAB_MIN 16
+#define SLAB_CLASSES 13
+#define SLAB_COMPACT_SLACK (8 * SLAB_SIZE)
+
+#define FIND_MAX_MATCHES (1 << 20)
+
+#define UNDO_MAX_BYTES (64 << 20)
+#define UNDO_NONE ((size_t)-1)
+
+#define SAVE_IOV 1024
+
+#define LOAD_CHUNK (8 << 20)
+#define LOAD_THREADS 16
+#define LOAD_BLOCK (1 << 20)
+
+#define DIFF_MAX_EDIT 1024
+#define DIFF_MAX_WORK (1 << 26)
+
+#define PROF_SUB 3
+#define PROF_BUCKETS ((64 - PROF_SUB + 1) << PROF_SUB)
+
+#define CELL_REVERSE (1 << 0)
+#define CELL_BYTES 7
+#define FB_GAP 4
+
+#ifdef MARROW_BENCH
+#define BENCH_ROWS 40
+#define BENCH_COLS 120
+
+void *benchMalloc(size_t size);
+void *benchCalloc(size_t n, size_t size);
+void *benchRealloc(void *p, size_t size);
+void benchKey();
+
+#define malloc(size) benchMalloc(size)
+#define calloc(n, size) benchCalloc(n, size)
+#define realloc(p, size) benchRealloc(p, size)
+#endif
+
 /*** data ***/
+struct kwTrie {
+    unsigned char cls[256];
+    int nclass;
+    int nstates;
+    unsigned short *next;
+    unsigned char *hl;
+    unsigned short *prio;
+};
+
 struct editorSyntax {
     char *filetype;
     char **filematch;
@@ -60,18 +137,170 @@ struct editorSyntax {
     char *multiline_comment_start;
     char *multiline_comment_end;
     int flags;
+    struct kwTrie *kw;
+};
+
+struct hlSpan {
+    unsigned int start;
+    unsigned int len : 28;
+    unsigned int hl : 4;
+};
+
+struct widthRange {
+    unsigned int lo;
+    unsigned int hi;
+};
+
+struct widthStop {
+    int cx;
+    int rx;
+    int col;
+    int n;
+    unsigned char len;
+    unsigned char width;
 };
 
 typedef struct erow {
-    int idx;
+    struct ropeNode *leaf;
     int size;
     int rsize;
     char *chars;
     char *render;
-    unsigned char *hl;
+    struct hlSpan *hl;
+    int hlspans;
+    struct widthStop *stops;
+    int nstops;
+    int ntabs;
+    int charscap;
+    int rendercap;
+    int hlcap;
+    int stopscap;
+    int hl_in_comment;
     int hl_open_comment;
+    struct erow *hl_prev;
+    struct erow *hl_next;
+    int mapline;
+    int maplines;
 } erow;
 
+struct ropeNode {
+    struct ropeNode *parent;
+    int leaf;
+    int n;
+    int count;
+    union {
+        struct ropeNode *child[ROPE_MAX];
+        erow *row[ROPE_MAX];
+    } u;
+};
+
+struct findMatch {
+    int line;
+    int col;
+};
+
+struct findIndex {
+    int active;
+    char *query;
+    int qlen;
+    struct findMatch *m;
+    int n;
+    int cap;
+    int truncated;
+    int cur;
+    int origin_line;
+    int origin_col;
+};
+
+struct cell {
+    char ch[CELL_BYTES];
+    unsigned char len;
+    unsigned char fg;
+    unsigned char attr;
+};
+
+struct abuf {
+    char *b;
+    int len;
+    int cap;
+};
+
+#define ABUF_INIT                                                              \
+    { NULL, 0, 0 }
+
+enum fbSgr { SGR_FG = 0, SGR_PLAIN, SGR_REVERSE };
+
+enum profStage {
+    PROF_FRAME = 0,
+    PROF_INPUT,
+    PROF_SYNTAX,
+    PROF_DRAW,
+    PROF_FLUSH,
+    PROF_WRITE,
+    PROF_WORKER,
+    PROF_BYTES,
+    PROF_STAGES
+};
+
+struct profHist {
+    unsigned long count[PROF_BUCKETS];
+    unsigned long n;
+    unsigned long sum;
+    unsigned long max;
+};
+
+struct profState {
+    struct profHist hist[PROF_STAGES];
+    long acc[PROF_STAGES];
+    long frame;
+    size_t bytes;
+    int overlay;
+    char *dump;
+};
+
+enum undoKind { UNDO_SPLICE, UNDO_ROWS };
+
+/* A record is this header followed by the removed bytes and the inserted
+ * bytes. UNDO_ROWS records keep whole rows joined by '\n'. */
+struct undoRec {
+    size_t size;
+    size_t prevsize;
+    size_t dellen;
+    size_t inslen;
+    int kind;
+    int group;
+    int typing;
+    int line;
+    int col;
+    int delrows;
+    int insrows;
+    int cx, cy;
+    int acx, acy;
+};
+
+struct undoLog {
+    char *buf;
+    size_t cap;
+    size_t start;
+    size_t len;
+    size_t pos;
+    size_t last;
+    size_t saved;
+    int group;
+    int newgroup;
+    int typing;
+    int paused;
+    int cx, cy;
+};
+
+struct slabPool {
+    char *slabs;
+    size_t off;
+    void *free[SLAB_CLASSES];
+    size_t used;
+    size_t reserved;
+};
+
 struct editorConfig {
     int cx, cy;
     int rx;
@@ -79,13 +308,72 @@ struct editorConfig {
     int coloff;
     int screenrows;
     int screencols;
+    struct cell *fbfront;
+    struct cell *fbback;
+    int fbrows;
+    int fbcols;
+    int fbfull;
+    int fbcx, fbcy;
+    struct abuf frame;
+    char sgr[3][10][12];
+    int sgrlen[3][10];
+    volatile sig_atomic_t resized;
+    int redraw;
+    int winchpipe[2];
+    int infd;
+    int outfd;
+    int recordfd;
+    int headless;
+    size_t outbytes;
+    unsigned char inbuf[INPUT_RING];
+    unsigned int inhead, intail;
     int numrows;
-    erow *row;
+    struct ropeNode *rows;
+    char *map;
+    size_t mapsize;
+    size_t mapcap;
+    size_t *mapoff;
+    int maplines;
+    int mapoffcap;
+    int streamfd;
+    ino_t mapino;
+    volatile sig_atomic_t maptruncated;
+    int mapstale;
+    long pagesize;
+    struct stat disk;
+    int diskchanged;
+    int prompting;
+    int follow;
+    int watchfd;
+    int watchwd;
+    ino_t watchino;
     int dirty;
     char *filename;
     char statusmsg[80];
     time_t statusmsg_time;
     struct editorSyntax *syntax;
+    unsigned char *hlcheck;
+    int hlchecks;
+    int hlcheckn;
+    int hlcheckcap;
+    int hlcache_line;
+    int hlcache_state;
+    unsigned long hlversion;
+    int hlwait;
+    pthread_t hlworker;
+    pthread_mutex_t lock;
+    pthread_cond_t hlcond;
+    erow *hlhead;
+    erow *hltail;
+    int hlrows;
+    unsigned char *hlbuf;
+    int hlbufcap;
+    struct widthStop *stopbuf;
+    int stopbufcap;
+    struct findIndex find;
+    struct undoLog undo;
+    struct slabPool slab;
+    struct profState prof;
     struct termios orig_termios;
 };
 
@@ -108,29 +396,141 @@ char *ARSON_HL_keywords[] = {
 
 struct editorSyntax HLDB[] = {
     {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS, NULL},
     {"arson", ARSON_HL_extensions, ARSON_HL_keywords, "#", NULL, NULL,
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS}};
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS, NULL}};
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
 /*** prototypes ***/
 
 void editorSetStatusMessage(const char *fmt, ...);
+void editorRenderRow(erow *row);
+void editorFreeRow(erow *row);
 void editorRefreshScreen();
+int editorSyntaxPending();
+void editorStreamRead();
+void editorWatchCheck();
+void editorCompactRows();
+void undoSplice(erow *row, int at, int del, char *s, int ins);
+void undoRows(int line, int delrows, char *del, size_t dellen, int insrows);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
 
+/*** profiler ***/
+
+char *PROF_NAMES[PROF_STAGES] = {"frame", "input", "syntax", "draw",
+                                 "flush", "write", "worker", "bytes"};
+
+long profNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int profBucket(unsigned long v) {
+    int b = PROF_SUB;
+    if (v < (1UL << PROF_SUB))
+        return v;
+    while (v >> b > 1)
+        b++;
+    return ((b - PROF_SUB + 1) << PROF_SUB) +
+           ((v >> (b - PROF_SUB)) & ((1 << PROF_SUB) - 1));
+}
+
+unsigned long profBucketValue(int k) {
+    if (k < (1 << PROF_SUB))
+        return k;
+    int b = (k >> PROF_SUB) + PROF_SUB - 1;
+    return ((1UL << PROF_SUB) + (k & ((1 << PROF_SUB) - 1))) << (b - PROF_SUB);
+}
+
+void profRecord(int stage, long v) {
+    struct profHist *h = &E.prof.hist[stage];
+    if (v < 0)
+        v = 0;
+    h->count[profBucket(v)]++;
+    h->n++;
+    h->sum += v;
+    if ((unsigned long)v > h->max)
+        h->max = v;
+}
+
+unsigned long profPercentile(int stage, int pct) {
+    struct profHist *h = &E.prof.hist[stage];
+    unsigned long want = (h->n * pct + 99) / 100;
+    unsigned long seen = 0;
+    int k;
+    for (k = 0; k < PROF_BUCKETS; k++) {
+        seen += h->count[k];
+        if (seen && seen >= want)
+            return profBucketValue(k);
+    }
+    return 0;
+}
+
+long profBegin() {
+    long now = profNow();
+    if (!E.prof.frame)
+        E.prof.frame = now;
+    return now;
+}
+
+void profAdd(int stage, long start) {
+    if (E.prof.frame)
+        E.prof.acc[stage] += profNow() - start;
+}
+
+void profFrame() {
+    int j;
+    profRecord(PROF_FRAME, profNow() - E.prof.frame);
+    for (j = PROF_INPUT; j <= PROF_WRITE; j++) {
+        profRecord(j, E.prof.acc[j]);
+        E.prof.acc[j] = 0;
+    }
+    profRecord(PROF_BYTES, E.outbytes - E.prof.bytes);
+    E.prof.bytes = E.outbytes;
+    E.prof.frame = 0;
+}
+
+void profDump() {
+    FILE *fp = fopen(E.prof.dump, "w");
+    int j, k;
+    if (!fp)
+        return;
+
+    fprintf(fp, "# stage n mean p50 p90 p99 max (ns, bytes for bytes)\n");
+    for (j = 0; j < PROF_STAGES; j++) {
+        struct profHist *h = &E.prof.hist[j];
+        fprintf(fp, "%s %lu %lu %lu %lu %lu %lu\n", PROF_NAMES[j], h->n,
+                h->n ? h->sum / h->n : 0, profPercentile(j, 50),
+                profPercentile(j, 90), profPercentile(j, 99), h->max);
+    }
+    fprintf(fp, "# stage bucket count\n");
+    for (j = 0; j < PROF_STAGES; j++)
+        for (k = 0; k < PROF_BUCKETS; k++)
+            if (E.prof.hist[j].count[k])
+                fprintf(fp, "%s %lu %lu\n", PROF_NAMES[j], profBucketValue(k),
+                        E.prof.hist[j].count[k]);
+    fclose(fp);
+}
+
 /*** terminal ***/
 
+void editorWrite(const char *s, int len) {
+    E.outbytes += len;
+    write(E.outfd, s, len);
+}
+
 void die(const char *s) {
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    editorWrite("\x1b[2J", 4);
+    editorWrite("\x1b[H", 3);
 
     perror(s);
     exit(1);
 }
 
 void disableRawMode() {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
         die("tcsetattr");
 }
@@ -150,29 +550,178 @@ void enableRawMode() {
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
         die("tcsetattr");
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editorReadKey() {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN)
-            die("read");
+void editorHandleWinch(int sig) {
+    int saved_errno = errno;
+    (void)sig;
+    E.resized = 1;
+    write(E.winchpipe[1], "", 1);
+    errno = saved_errno;
+}
+
+/* Reading a page of E.map past the end of a file truncated underneath us
+ * raises SIGBUS. Back the rest of the mapping with zero pages so the read
+ * completes, and let the main loop reload the file. */
+void editorHandleBus(int sig, siginfo_t *si, void *ctx) {
+    char *addr = si->si_addr;
+    (void)ctx;
+    if (E.map == NULL || E.mapcap || addr < E.map ||
+        addr >= E.map + E.mapsize) {
+        signal(sig, SIG_DFL);
+        return;
+    }
+    char *from = E.map + ((addr - E.map) & ~(E.pagesize - 1));
+    if (mmap(from, E.map + E.mapsize - from, PROT_READ,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        signal(sig, SIG_DFL);
+        return;
+    }
+    E.maptruncated = 1;
+    write(E.winchpipe[1], "", 1);
+}
+
+void editorRecordInput(unsigned int at, int len) {
+    int n = INPUT_RING - at % INPUT_RING;
+    if (n > len)
+        n = len;
+    write(E.recordfd, &E.inbuf[at % INPUT_RING], n);
+    if (len > n)
+        write(E.recordfd, E.inbuf, len - n);
+}
+
+int editorPoll(int timeout) {
+    struct pollfd fds[4];
+    fds[0].fd = E.infd;
+    fds[0].events = POLLIN;
+    fds[1].fd = E.winchpipe[0];
+    fds[1].events = POLLIN;
+    fds[2].fd = E.streamfd;
+    fds[2].events = POLLIN;
+    fds[3].fd = E.watchfd;
+    fds[3].events = POLLIN;
+
+    if (editorSyntaxPending())
+        pthread_cond_signal(&E.hlcond);
+    pthread_mutex_unlock(&E.lock);
+    int n = poll(fds, 4, timeout);
+    pthread_mutex_lock(&E.lock);
+    if (n == -1) {
+        if (errno == EINTR)
+            return 0;
+        die("poll");
     }
 
+    if (fds[1].revents & POLLIN) {
+        char buf[64];
+        while (read(E.winchpipe[0], buf, sizeof(buf)) > 0)
+            ;
+        if (E.maptruncated && E.filename)
+            editorWatchCheck();
+    }
+
+    if (E.streamfd != -1 && (fds[2].revents & (POLLIN | POLLHUP | POLLERR))) {
+        editorStreamRead();
+        E.redraw = 1;
+    }
+
+    if (fds[3].revents & POLLIN) {
+        char buf[4096];
+        while (read(E.watchfd, buf, sizeof(buf)) > 0)
+            ;
+        editorWatchCheck();
+    }
+
+    if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+        return 0;
+
+    unsigned int used = E.intail - E.inhead;
+    unsigned int at = E.intail % INPUT_RING;
+    struct iovec iov[2];
+    iov[0].iov_base = &E.inbuf[at];
+    iov[0].iov_len = INPUT_RING - at;
+    iov[1].iov_base = E.inbuf;
+    iov[1].iov_len = at;
+    if (iov[0].iov_len > INPUT_RING - used)
+        iov[0].iov_len = INPUT_RING - used;
+    if (iov[1].iov_len > INPUT_RING - used - iov[0].iov_len)
+        iov[1].iov_len = INPUT_RING - used - iov[0].iov_len;
+    if (iov[0].iov_len == 0)
+        return 0;
+
+    ssize_t nread = readv(E.infd, iov, iov[1].iov_len ? 2 : 1);
+    if (nread == -1 && errno != EAGAIN && errno != EINTR)
+        die("read");
+    if (nread == 0 && E.headless)
+        exit(0);
+    if (nread == 0 && (fds[0].revents & POLLHUP))
+        die("read");
+    if (nread > 0) {
+        if (E.recordfd != -1)
+            editorRecordInput(E.intail, nread);
+        E.intail += nread;
+    }
+    return nread > 0;
+}
+
+int editorReadByte(int timeout) {
+    if (E.inhead == E.intail && !editorPoll(timeout))
+        return -1;
+    return E.inbuf[E.inhead++ % INPUT_RING];
+}
+
+void editorWaitInput() {
+    int busy = 1;
+#ifdef MARROW_BENCH
+    benchKey();
+#endif
+    while (E.inhead == E.intail && !(E.diskchanged && !E.prompting)) {
+        if (E.resized || E.redraw)
+            editorRefreshScreen();
+
+        int timeout = -1;
+        time_t age = time(NULL) - E.statusmsg_time;
+        if (busy)
+            timeout = 0;
+        else if (E.statusmsg[0] && age < 5)
+            timeout = (5 - age) * 1000;
+
+        if (editorPoll(timeout) || timeout == -1)
+            continue;
+        if (busy) {
+            busy = 0;
+            editorCompactRows();
+        } else
+            editorRefreshScreen();
+    }
+}
+
+int editorDecodeKey() {
+    int c = editorReadByte(0);
+
     if (c == '\x1b') {
-        char seq[3];
+        int seq[5];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1)
+        if ((seq[0] = editorReadByte(ESC_TIMEOUT)) == -1)
             return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1)
+        if ((seq[1] = editorReadByte(ESC_TIMEOUT)) == -1)
             return '\x1b';
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1)
+                if ((seq[2] = editorReadByte(ESC_TIMEOUT)) == -1)
                     return '\x1b';
-                if (seq[2] == '~') {
+                if (seq[1] == '2' && seq[2] == '0') {
+                    if ((seq[3] = editorReadByte(ESC_TIMEOUT)) == -1)
+                        return '\x1b';
+                    if ((seq[4] = editorReadByte(ESC_TIMEOUT)) == -1)
+                        return '\x1b';
+                    if (seq[3] == '0' && seq[4] == '~')
+                        return PASTE_START;
+                    if (seq[3] == '1' && seq[4] == '~')
+                        return PASTE_END;
+                } else if (seq[2] == '~') {
                     switch (seq[1]) {
                     case '1':
                         return HOME_KEY;
@@ -217,8 +766,20 @@ int editorReadKey() {
 
         return '\x1b';
     } else {
-        return c;
+        return (char)c;
+    }
+}
+
+int editorReadKey() {
+    editorWaitInput();
+    if (E.diskchanged && !E.prompting) {
+        E.diskchanged = 0;
+        return DISK_CHANGED;
     }
+    long start = profBegin();
+    int c = editorDecodeKey();
+    profAdd(PROF_INPUT, start);
+    return c;
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -259,468 +820,3113 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
-/*** syntax highlighting ***/
+/*** row storage ***/
 
-int is_separator(int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+int slabClass(int size) {
+    int c = 0;
+    while (c < SLAB_CLASSES && (SLAB_MIN << c) < size)
+        c++;
+    return c;
 }
 
-void editorUpdateSyntax(erow *row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+void *slabAlloc(int size, int *cap) {
+    struct slabPool *sp = &E.slab;
+    int c = slabClass(size);
+    if (c >= SLAB_CLASSES) {
+        void *p = malloc(size);
+        if (p == NULL)
+            die("malloc");
+        *cap = size;
+        sp->used += size;
+        sp->reserved += size;
+        return p;
+    }
+
+    *cap = SLAB_MIN << c;
+    sp->used += *cap;
+    if (sp->free[c]) {
+        void *p = sp->free[c];
+        sp->free[c] = *(void **)p;
+        return p;
+    }
+    if (sp->slabs == NULL || sp->off + *cap > SLAB_SIZE) {
+        char *slab = malloc(SLAB_SIZE);
+        if (slab == NULL)
+            die("malloc");
+        *(char **)slab = sp->slabs;
+        sp->slabs = slab;
+        sp->off = SLAB_HEADER;
+        sp->reserved += SLAB_SIZE;
+    }
+    void *p = sp->slabs + sp->off;
+    sp->off += *cap;
+    return p;
+}
 
-    if (E.syntax == NULL)
+void slabFree(void *p, int cap) {
+    struct slabPool *sp = &E.slab;
+    if (p == NULL)
         return;
+    sp->used -= cap;
+    int c = slabClass(cap);
+    if (c >= SLAB_CLASSES) {
+        sp->reserved -= cap;
+        free(p);
+        return;
+    }
+    *(void **)p = sp->free[c];
+    sp->free[c] = p;
+}
 
-    char **keywords = E.syntax->keywords;
+void *slabRealloc(void *p, int *cap, int size) {
+    if (p && size <= *cap)
+        return p;
+    int oldcap = p ? *cap : 0;
+    void *new = slabAlloc(size > oldcap * 2 ? size : oldcap * 2, cap);
+    if (p) {
+        memcpy(new, p, oldcap);
+        slabFree(p, oldcap);
+    }
+    return new;
+}
 
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
+void slabStats(size_t *used, size_t *reserved) {
+    *used = E.slab.used;
+    *reserved = E.slab.reserved;
+}
 
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
+void *slabMove(void *p, int *cap, int size) {
+    if (p == NULL || slabClass(*cap) >= SLAB_CLASSES)
+        return p;
+    int oldcap = *cap;
+    void *new = slabAlloc(size, cap);
+    memcpy(new, p, size);
+    E.slab.used -= oldcap;
+    return new;
+}
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+/*** text buffer ***/
 
-    int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+int ropeWeight(erow *row) { return row->maplines ? row->maplines : 1; }
 
-        if (scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
-            }
+void ropeRecount(struct ropeNode *node) {
+    int j;
+    node->count = 0;
+    for (j = 0; j < node->n; j++) {
+        if (node->leaf) {
+            node->u.row[j]->leaf = node;
+            node->count += ropeWeight(node->u.row[j]);
+        } else {
+            node->u.child[j]->parent = node;
+            node->count += node->u.child[j]->count;
         }
+    }
+}
 
-        if (mcs_len && mce_len && !in_string) {
-            if (in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                } else {
-                    i++;
-                    continue;
-                }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
-            }
-        }
+void ropeAddCount(struct ropeNode *node, int delta) {
+    for (; node; node = node->parent)
+        node->count += delta;
+}
 
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (in_string) {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->rsize) {
-                    row->hl[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
-                if (c == in_string)
-                    in_string = 0;
-                i++;
-                prev_sep = 1;
-                continue;
-            } else {
-                if (c == '"' || c == '\'') {
-                    in_string = c;
-                    row->hl[i] = HL_STRING;
-                    i++;
-                    continue;
-                }
-            }
-        }
+int ropeChildIndex(struct ropeNode *node) {
+    int j;
+    for (j = 0; node->parent->u.child[j] != node; j++)
+        ;
+    return j;
+}
 
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if (isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
-                i++;
-                prev_sep = 0;
-                continue;
-            }
+struct ropeNode *ropeFindLeaf(struct ropeNode *node, int *at) {
+    while (!node->leaf) {
+        int j;
+        for (j = 0; j < node->n - 1; j++) {
+            if (*at < node->u.child[j]->count)
+                break;
+            *at -= node->u.child[j]->count;
         }
+        node = node->u.child[j];
+    }
+    return node;
+}
 
-        if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2)
-                    klen--;
-
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    is_separator(row->render[i + klen])) {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL) {
-                prev_sep = 0;
-                continue;
-            }
-        }
+int ropeFindSlot(struct ropeNode *leaf, int *at) {
+    int j = 0;
+    while (j < leaf->n && *at >= ropeWeight(leaf->u.row[j])) {
+        *at -= ropeWeight(leaf->u.row[j]);
+        j++;
+    }
+    return j;
+}
 
-        prev_sep = is_separator(c);
-        i++;
+void ropeSplit(struct ropeNode **root, struct ropeNode *node) {
+    if (node->parent == NULL) {
+        struct ropeNode *top = calloc(1, sizeof(struct ropeNode));
+        top->n = 1;
+        top->u.child[0] = node;
+        ropeRecount(top);
+        *root = top;
+    } else if (node->parent->n == ROPE_MAX) {
+        ropeSplit(root, node->parent);
     }
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numrows)
-        editorUpdateSyntax(&E.row[row->idx + 1]);
+    struct ropeNode *parent = node->parent;
+    struct ropeNode *sib = calloc(1, sizeof(struct ropeNode));
+    int half = node->n / 2;
+    sib->leaf = node->leaf;
+    sib->n = node->n - half;
+    memcpy(&sib->u, &node->u.child[half], sizeof(void *) * sib->n);
+    node->n = half;
+    ropeRecount(node);
+    ropeRecount(sib);
+
+    int j = ropeChildIndex(node) + 1;
+    memmove(&parent->u.child[j + 1], &parent->u.child[j],
+            sizeof(void *) * (parent->n - j));
+    parent->u.child[j] = sib;
+    parent->n++;
+    sib->parent = parent;
 }
 
-int editorSyntaxToColor(int hl) {
-    switch (hl) {
-    case HL_COMMENT:
-    case HL_MLCOMMENT:
-        return 36;
-    case HL_KEYWORD1:
-        return 33;
-    case HL_KEYWORD2:
-        return 32;
-    case HL_STRING:
-        return 35;
-    case HL_NUMBER:
-        return 31;
-    case HL_MATCH:
-        return 34;
-    default:
-        return 37;
+void ropeRebalance(struct ropeNode **root, struct ropeNode *node) {
+    struct ropeNode *parent = node->parent;
+
+    if (parent == NULL) {
+        if (!node->leaf && node->n == 1) {
+            *root = node->u.child[0];
+            (*root)->parent = NULL;
+            free(node);
+        } else if (node->n == 0) {
+            *root = NULL;
+            free(node);
+        }
+        return;
     }
-}
+    if (node->n >= ROPE_MAX / 4)
+        return;
 
-void editorSelectSyntaxHighlight() {
-    E.syntax = NULL;
-    if (E.filename == NULL)
+    int j = ropeChildIndex(node);
+    if (node->n == 0) {
+        memmove(&parent->u.child[j], &parent->u.child[j + 1],
+                sizeof(void *) * (parent->n - j - 1));
+        parent->n--;
+        free(node);
+        ropeRebalance(root, parent);
         return;
+    }
 
-    char *ext = strrchr(E.filename, '.');
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-        struct editorSyntax *s = &HLDB[j];
-        unsigned int i = 0;
-        while (s->filematch[i]) {
-            int is_ext = (s->filematch[i][0] == '.');
-            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-                (!is_ext && strstr(E.filename, s->filematch[i]))) {
-                E.syntax = s;
+    struct ropeNode *left, *right;
+    if (j + 1 < parent->n) {
+        left = node;
+        right = parent->u.child[j + 1];
+    } else if (j > 0) {
+        left = parent->u.child[j - 1];
+        right = node;
+        j--;
+    } else {
+        ropeRebalance(root, parent);
+        return;
+    }
+    if (left->n + right->n > ROPE_MAX)
+        return;
 
-                int filerow;
-                for (filerow = 0; filerow < E.numrows; filerow++) {
-                    editorUpdateSyntax(&E.row[filerow]);
-                }
+    memcpy(&left->u.child[left->n], &right->u, sizeof(void *) * right->n);
+    left->n += right->n;
+    ropeRecount(left);
+    free(right);
 
-                return;
-            }
-            i++;
-        }
-    }
+    memmove(&parent->u.child[j + 1], &parent->u.child[j + 2],
+            sizeof(void *) * (parent->n - j - 2));
+    parent->n--;
+    ropeRebalance(root, parent);
 }
 
-/*** row operations ***/
+struct ropeNode *ropeFirstLeaf(struct ropeNode *node) {
+    while (node && !node->leaf)
+        node = node->u.child[0];
+    return node;
+}
 
-int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t')
-            rx += (MARROW_TAB_STOP - 1) - (rx % MARROW_TAB_STOP);
-        rx++;
+struct ropeNode *ropeNextLeaf(struct ropeNode *node) {
+    for (; node->parent; node = node->parent) {
+        int j = ropeChildIndex(node);
+        if (j + 1 < node->parent->n)
+            return ropeFirstLeaf(node->parent->u.child[j + 1]);
     }
-    return rx;
+    return NULL;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t')
-            cur_rx += (MARROW_TAB_STOP - 1) - (cur_rx % MARROW_TAB_STOP);
-        cur_rx++;
-        if (cur_rx > rx)
-            return cx;
-    }
-    return cx;
+erow *ropeAt(struct ropeNode *root, int at, int *off) {
+    struct ropeNode *leaf = ropeFindLeaf(root, &at);
+    erow *row = leaf->u.row[ropeFindSlot(leaf, &at)];
+    *off = at;
+    return row;
 }
 
-void editorUpdateRow(erow *row) {
-    int tabs = 0;
+int ropeIndexOf(erow *row) {
+    struct ropeNode *node = row->leaf;
+    int idx = 0;
     int j;
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t')
-            tabs++;
+    for (j = 0; node->u.row[j] != row; j++)
+        idx += ropeWeight(node->u.row[j]);
+    for (; node->parent; node = node->parent) {
+        int j;
+        for (j = 0; node->parent->u.child[j] != node; j++)
+            idx += node->parent->u.child[j]->count;
+    }
+    return idx;
+}
 
-    free(row->render);
-    row->render = malloc(row->size + tabs * (MARROW_TAB_STOP - 1) + 1);
+void ropeInsert(struct ropeNode **root, int at, erow *row) {
+    if (*root == NULL) {
+        *root = calloc(1, sizeof(struct ropeNode));
+        (*root)->leaf = 1;
+    }
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % MARROW_TAB_STOP != 0)
-                row->render[idx++] = ' ';
+    int pos = at;
+    struct ropeNode *leaf = ropeFindLeaf(*root, &pos);
+    if (leaf->n == ROPE_MAX) {
+        ropeSplit(root, leaf);
+        pos = at;
+        leaf = ropeFindLeaf(*root, &pos);
+    }
+    int j = ropeFindSlot(leaf, &pos);
+
+    memmove(&leaf->u.row[j + 1], &leaf->u.row[j],
+            sizeof(erow *) * (leaf->n - j));
+    leaf->u.row[j] = row;
+    leaf->n++;
+    row->leaf = leaf;
+    ropeAddCount(leaf, ropeWeight(row));
+}
+
+erow *ropeDelete(struct ropeNode **root, int at) {
+    struct ropeNode *leaf = ropeFindLeaf(*root, &at);
+    int j = ropeFindSlot(leaf, &at);
+    erow *row = leaf->u.row[j];
+
+    memmove(&leaf->u.row[j], &leaf->u.row[j + 1],
+            sizeof(erow *) * (leaf->n - j - 1));
+    leaf->n--;
+    ropeAddCount(leaf, -ropeWeight(row));
+    ropeRebalance(root, leaf);
+    return row;
+}
+
+void ropeResize(erow *run, int maplines) {
+    int delta = maplines - run->maplines;
+    run->maplines = maplines;
+    ropeAddCount(run->leaf, delta);
+}
+
+void ropeFree(struct ropeNode *node) {
+    int j;
+    for (j = 0; j < node->n; j++) {
+        if (node->leaf) {
+            editorFreeRow(node->u.row[j]);
+            free(node->u.row[j]);
         } else {
-            row->render[idx++] = row->chars[j];
+            ropeFree(node->u.child[j]);
         }
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
-    editorUpdateSyntax(row);
+    free(node);
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numrows)
+char *editorLineAt(char *map, size_t *off, int line, int *len) {
+    size_t start = off[line];
+    size_t end = off[line + 1];
+    while (end > start && (map[end - 1] == '\n' || map[end - 1] == '\r'))
+        end--;
+    *len = end - start;
+    return &map[start];
+}
+
+char *editorMapLine(int line, int *len) {
+    return editorLineAt(E.map, E.mapoff, line, len);
+}
+
+erow *editorMapRun(int line, int count) {
+    erow *run = calloc(1, sizeof(erow));
+    run->mapline = line;
+    run->maplines = count;
+    return run;
+}
+
+erow *editorNewRow(int at, char *s, size_t len) {
+    erow *row = calloc(1, sizeof(erow));
+    row->mapline = -1;
+    ropeInsert(&E.rows, at, row);
+
+    row->size = len;
+    row->chars = slabAlloc(len + 1, &row->charscap);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+    return row;
+}
+
+erow *editorPeekRow(int at) {
+    if (at < 0 || at >= E.numrows)
+        return NULL;
+    int off;
+    erow *row = ropeAt(E.rows, at, &off);
+    return row->maplines ? NULL : row;
+}
+
+erow *editorRowAt(int at) {
+    int off;
+    erow *run = ropeAt(E.rows, at, &off);
+    if (!run->maplines)
+        return run;
+
+    int line = run->mapline + off;
+    int rest = run->maplines - off - 1;
+    if (off == 0) {
+        ropeDelete(&E.rows, at);
+        free(run);
+    } else {
+        ropeResize(run, off);
+    }
+    if (rest > 0)
+        ropeInsert(&E.rows, at, editorMapRun(line + 1, rest));
+
+    int len;
+    char *s = editorMapLine(line, &len);
+    erow *row = editorNewRow(at, s, len);
+    row->mapline = line;
+    editorRenderRow(row);
+    return row;
+}
+
+char *editorRowChars(int at, int *len) {
+    erow *row = editorPeekRow(at);
+    if (row) {
+        *len = row->size;
+        return row->chars;
+    }
+    int off;
+    row = ropeAt(E.rows, at, &off);
+    return editorMapLine(row->mapline + off, len);
+}
+
+void editorFreeRows() {
+    if (E.rows)
+        ropeFree(E.rows);
+    E.rows = NULL;
+    E.numrows = 0;
+}
+
+void editorCompactRows() {
+    size_t used, reserved;
+    slabStats(&used, &reserved);
+    if (reserved < used + SLAB_COMPACT_SLACK || reserved < 2 * used)
         return;
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    for (int j = at + 1; j <= E.numrows; j++)
-        E.row[j].idx++;
+    struct slabPool old = E.slab;
+    memset(E.slab.free, 0, sizeof(E.slab.free));
+    E.slab.slabs = NULL;
+    E.slab.off = 0;
+    char *slab;
+    for (slab = old.slabs; slab; slab = *(char **)slab)
+        E.slab.reserved -= SLAB_SIZE;
+
+    struct ropeNode *leaf;
+    for (leaf = ropeFirstLeaf(E.rows); leaf; leaf = ropeNextLeaf(leaf)) {
+        int j;
+        for (j = 0; j < leaf->n; j++) {
+            erow *row = leaf->u.row[j];
+            if (row->maplines)
+                continue;
+            row->chars = slabMove(row->chars, &row->charscap, row->size + 1);
+            if (row->rendercap)
+                row->render =
+                    slabMove(row->render, &row->rendercap, row->rsize + 1);
+            else
+                row->render = row->chars;
+            row->stops = slabMove(row->stops, &row->stopscap,
+                                  row->nstops * sizeof(struct widthStop));
+            row->hl = slabMove(row->hl, &row->hlcap,
+                               row->hlspans * sizeof(struct hlSpan));
+        }
+    }
+
+    while (old.slabs) {
+        char *next = *(char **)old.slabs;
+        free(old.slabs);
+        old.slabs = next;
+    }
+}
 
-    E.row[at].idx = at;
+/*** text width ***/
+
+struct widthRange ZERO_WIDTH[] = {
+    {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf},
+    {0x05c1, 0x05c2}, {0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0600, 0x0605},
+    {0x0610, 0x061a}, {0x061c, 0x061c}, {0x064b, 0x065f}, {0x0670, 0x0670},
+    {0x06d6, 0x06dd}, {0x06df, 0x06e4}, {0x06e7, 0x06e8}, {0x06ea, 0x06ed},
+    {0x070f, 0x070f}, {0x0711, 0x0711}, {0x0730, 0x074a}, {0x07a6, 0x07b0},
+    {0x07eb, 0x07f3}, {0x07fd, 0x07fd}, {0x0816, 0x0819}, {0x081b, 0x0823},
+    {0x0825, 0x0827}, {0x0829, 0x082d}, {0x0859, 0x085b}, {0x0890, 0x089f},
+    {0x08ca, 0x0902}, {0x093a, 0x093a}, {0x093c, 0x093c}, {0x0941, 0x0948},
+    {0x094d, 0x094d}, {0x0951, 0x0957}, {0x0962, 0x0963}, {0x0981, 0x0981},
+    {0x09bc, 0x09bc}, {0x09c1, 0x09c4}, {0x09cd, 0x09cd}, {0x09e2, 0x09e3},
+    {0x09fe, 0x0a02}, {0x0a3c, 0x0a3c}, {0x0a41, 0x0a51}, {0x0a70, 0x0a71},
+    {0x0a75, 0x0a75}, {0x0a81, 0x0a82}, {0x0abc, 0x0abc}, {0x0ac1, 0x0ac8},
+    {0x0acd, 0x0acd}, {0x0ae2, 0x0ae3}, {0x0afa, 0x0b01}, {0x0b3c, 0x0b3c},
+    {0x0b3f, 0x0b3f}, {0x0b41, 0x0b44}, {0x0b4d, 0x0b56}, {0x0b62, 0x0b63},
+    {0x0b82, 0x0b82}, {0x0bc0, 0x0bc0}, {0x0bcd, 0x0bcd}, {0x0c00, 0x0c00},
+    {0x0c04, 0x0c04}, {0x0c3c, 0x0c3c}, {0x0c3e, 0x0c40}, {0x0c46, 0x0c56},
+    {0x0c62, 0x0c63}, {0x0c81, 0x0c81}, {0x0cbc, 0x0cbc}, {0x0cbf, 0x0cbf},
+    {0x0cc6, 0x0cc6}, {0x0ccc, 0x0ccd}, {0x0ce2, 0x0ce3}, {0x0d00, 0x0d01},
+    {0x0d3b, 0x0d3c}, {0x0d41, 0x0d44}, {0x0d4d, 0x0d4d}, {0x0d62, 0x0d63},
+    {0x0d81, 0x0d81}, {0x0dca, 0x0dca}, {0x0dd2, 0x0dd6}, {0x0e31, 0x0e31},
+    {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e}, {0x0eb1, 0x0eb1}, {0x0eb4, 0x0ebc},
+    {0x0ec8, 0x0ecd}, {0x0f18, 0x0f19}, {0x0f35, 0x0f35}, {0x0f37, 0x0f37},
+    {0x0f39, 0x0f39}, {0x0f71, 0x0f7e}, {0x0f80, 0x0f84}, {0x0f86, 0x0f87},
+    {0x0f8d, 0x0fbc}, {0x0fc6, 0x0fc6}, {0x102d, 0x1030}, {0x1032, 0x1037},
+    {0x1039, 0x103a}, {0x103d, 0x103e}, {0x1058, 0x1059}, {0x105e, 0x1060},
+    {0x1071, 0x1074}, {0x1082, 0x1082}, {0x1085, 0x1086}, {0x108d, 0x108d},
+    {0x109d, 0x109d}, {0x1160, 0x11ff}, {0x135d, 0x135f}, {0x1712, 0x1714},
+    {0x1732, 0x1733}, {0x1752, 0x1753}, {0x1772, 0x1773}, {0x17b4, 0x17b5},
+    {0x17b7, 0x17bd}, {0x17c6, 0x17c6}, {0x17c9, 0x17d3}, {0x17dd, 0x17dd},
+    {0x180b, 0x180f}, {0x1885, 0x1886}, {0x18a9, 0x18a9}, {0x1920, 0x1922},
+    {0x1927, 0x1928}, {0x1932, 0x1932}, {0x1939, 0x193b}, {0x1a17, 0x1a18},
+    {0x1a1b, 0x1a1b}, {0x1a56, 0x1a56}, {0x1a58, 0x1a60}, {0x1a62, 0x1a62},
+    {0x1a65, 0x1a6c}, {0x1a73, 0x1a7f}, {0x1ab0, 0x1b03}, {0x1b34, 0x1b34},
+    {0x1b36, 0x1b3a}, {0x1b3c, 0x1b3c}, {0x1b42, 0x1b42}, {0x1b6b, 0x1b73},
+    {0x1b80, 0x1b81}, {0x1ba2, 0x1ba5}, {0x1ba8, 0x1ba9}, {0x1bab, 0x1bad},
+    {0x1be6, 0x1be6}, {0x1be8, 0x1be9}, {0x1bed, 0x1bed}, {0x1bef, 0x1bf1},
+    {0x1c2c, 0x1c33}, {0x1c36, 0x1c37}, {0x1cd0, 0x1cd2}, {0x1cd4, 0x1ce0},
+    {0x1ce2, 0x1ce8}, {0x1ced, 0x1ced}, {0x1cf4, 0x1cf4}, {0x1cf8, 0x1cf9},
+    {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x202a, 0x202e}, {0x2060, 0x206f},
+    {0x20d0, 0x20f0}, {0x2cef, 0x2cf1}, {0x2d7f, 0x2d7f}, {0x2de0, 0x2dff},
+    {0x302a, 0x302d}, {0x3099, 0x309a}, {0xa66f, 0xa672}, {0xa674, 0xa67d},
+    {0xa69e, 0xa69f}, {0xa6f0, 0xa6f1}, {0xa802, 0xa802}, {0xa806, 0xa806},
+    {0xa80b, 0xa80b}, {0xa825, 0xa826}, {0xa82c, 0xa82c}, {0xa8c4, 0xa8c5},
+    {0xa8e0, 0xa8f1}, {0xa8ff, 0xa8ff}, {0xa926, 0xa92d}, {0xa947, 0xa951},
+    {0xa980, 0xa982}, {0xa9b3, 0xa9b3}, {0xa9b6, 0xa9b9}, {0xa9bc, 0xa9bd},
+    {0xa9e5, 0xa9e5}, {0xaa29, 0xaa2e}, {0xaa31, 0xaa32}, {0xaa35, 0xaa36},
+    {0xaa43, 0xaa43}, {0xaa4c, 0xaa4c}, {0xaa7c, 0xaa7c}, {0xaab0, 0xaab0},
+    {0xaab2, 0xaab4}, {0xaab7, 0xaab8}, {0xaabe, 0xaabf}, {0xaac1, 0xaac1},
+    {0xaaec, 0xaaed}, {0xaaf6, 0xaaf6}, {0xabe5, 0xabe5}, {0xabe8, 0xabe8},
+    {0xabed, 0xabed}, {0xfb1e, 0xfb1e}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f},
+    {0xfeff, 0xfeff}, {0xfff9, 0xfffb}, {0x101fd, 0x101fd}, {0x102e0, 0x102e0},
+    {0x10376, 0x1037a}, {0x10a01, 0x10a0f}, {0x10a38, 0x10a3f},
+    {0x10ae5, 0x10ae6}, {0x10d24, 0x10d27}, {0x10eab, 0x10eac},
+    {0x10f46, 0x10f50}, {0x10f82, 0x10f85}, {0x11001, 0x11001},
+    {0x11038, 0x11046}, {0x11070, 0x11070}, {0x11073, 0x11074},
+    {0x1107f, 0x11081}, {0x110b3, 0x110b6}, {0x110b9, 0x110ba},
+    {0x110bd, 0x110bd}, {0x110c2, 0x110cd}, {0x11100, 0x11102},
+    {0x11127, 0x1112b}, {0x1112d, 0x11134}, {0x11173, 0x11173},
+    {0x11180, 0x11181}, {0x111b6, 0x111be}, {0x111c9, 0x111cc},
+    {0x111cf, 0x111cf}, {0x1122f, 0x11231}, {0x11234, 0x11234},
+    {0x11236, 0x11237}, {0x1123e, 0x1123e}, {0x112df, 0x112df},
+    {0x112e3, 0x112ea}, {0x11300, 0x11301}, {0x1133b, 0x1133c},
+    {0x11340, 0x11340}, {0x11366, 0x11374}, {0x11438, 0x1143f},
+    {0x11442, 0x11444}, {0x11446, 0x11446}, {0x1145e, 0x1145e},
+    {0x114b3, 0x114b8}, {0x114ba, 0x114ba}, {0x114bf, 0x114c0},
+    {0x114c2, 0x114c3}, {0x115b2, 0x115b5}, {0x115bc, 0x115bd},
+    {0x115bf, 0x115c0}, {0x115dc, 0x115dd}, {0x11633, 0x1163a},
+    {0x1163d, 0x1163d}, {0x1163f, 0x11640}, {0x116ab, 0x116ab},
+    {0x116ad, 0x116ad}, {0x116b0, 0x116b5}, {0x116b7, 0x116b7},
+    {0x1171d, 0x1171f}, {0x11722, 0x11725}, {0x11727, 0x1172b},
+    {0x1182f, 0x11837}, {0x11839, 0x1183a}, {0x1193b, 0x1193c},
+    {0x1193e, 0x1193e}, {0x11943, 0x11943}, {0x119d4, 0x119db},
+    {0x119e0, 0x119e0}, {0x11a01, 0x11a0a}, {0x11a33, 0x11a38},
+    {0x11a3b, 0x11a3e}, {0x11a47, 0x11a47}, {0x11a51, 0x11a56},
+    {0x11a59, 0x11a5b}, {0x11a8a, 0x11a96}, {0x11a98, 0x11a99},
+    {0x11c30, 0x11c3d}, {0x11c3f, 0x11c3f}, {0x11c92, 0x11ca7},
+    {0x11caa, 0x11cb0}, {0x11cb2, 0x11cb3}, {0x11cb5, 0x11cb6},
+    {0x11d31, 0x11d45}, {0x11d47, 0x11d47}, {0x11d90, 0x11d91},
+    {0x11d95, 0x11d95}, {0x11d97, 0x11d97}, {0x11ef3, 0x11ef4},
+    {0x13430, 0x13438}, {0x16af0, 0x16af4}, {0x16b30, 0x16b36},
+    {0x16f4f, 0x16f4f}, {0x16f8f, 0x16f92}, {0x16fe4, 0x16fe4},
+    {0x1bc9d, 0x1bc9e}, {0x1bca0, 0x1cf46}, {0x1d167, 0x1d169},
+    {0x1d173, 0x1d182}, {0x1d185, 0x1d18b}, {0x1d1aa, 0x1d1ad},
+    {0x1d242, 0x1d244}, {0x1da00, 0x1da36}, {0x1da3b, 0x1da6c},
+    {0x1da75, 0x1da75}, {0x1da84, 0x1da84}, {0x1da9b, 0x1daaf},
+    {0x1e000, 0x1e02a}, {0x1e130, 0x1e136}, {0x1e2ae, 0x1e2ae},
+    {0x1e2ec, 0x1e2ef}, {0x1e8d0, 0x1e8d6}, {0x1e944, 0x1e94a},
+    {0xe0001, 0xe01ef}
+};
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+struct widthRange DOUBLE_WIDTH[] = {
+    {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec},
+    {0x23f0, 0x23f0}, {0x23f3, 0x23f3}, {0x25fd, 0x25fe}, {0x2614, 0x2615},
+    {0x2648, 0x2653}, {0x267f, 0x267f}, {0x2693, 0x2693}, {0x26a1, 0x26a1},
+    {0x26aa, 0x26ab}, {0x26bd, 0x26be}, {0x26c4, 0x26c5}, {0x26ce, 0x26ce},
+    {0x26d4, 0x26d4}, {0x26ea, 0x26ea}, {0x26f2, 0x26f3}, {0x26f5, 0x26f5},
+    {0x26fa, 0x26fa}, {0x26fd, 0x26fd}, {0x2705, 0x2705}, {0x270a, 0x270b},
+    {0x2728, 0x2728}, {0x274c, 0x274c}, {0x274e, 0x274e}, {0x2753, 0x2755},
+    {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27b0, 0x27b0}, {0x27bf, 0x27bf},
+    {0x2b1b, 0x2b1c}, {0x2b50, 0x2b50}, {0x2b55, 0x2b55}, {0x2e80, 0x3029},
+    {0x302e, 0x303e}, {0x3041, 0x3096}, {0x309b, 0x3247}, {0x3250, 0x4dbf},
+    {0x4e00, 0xa4c6}, {0xa960, 0xa97c}, {0xac00, 0xd7a3}, {0xf900, 0xfad9},
+    {0xfe10, 0xfe19}, {0xfe30, 0xfe6b}, {0xff01, 0xff60}, {0xffe0, 0xffe6},
+    {0x16fe0, 0x16fe3}, {0x16ff0, 0x1b2fb}, {0x1f004, 0x1f004},
+    {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a},
+    {0x1f200, 0x1f320}, {0x1f32d, 0x1f335}, {0x1f337, 0x1f37c},
+    {0x1f37e, 0x1f393}, {0x1f3a0, 0x1f3ca}, {0x1f3cf, 0x1f3d3},
+    {0x1f3e0, 0x1f3f0}, {0x1f3f4, 0x1f3f4}, {0x1f3f8, 0x1f43e},
+    {0x1f440, 0x1f440}, {0x1f442, 0x1f4fc}, {0x1f4ff, 0x1f53d},
+    {0x1f54b, 0x1f54e}, {0x1f550, 0x1f567}, {0x1f57a, 0x1f57a},
+    {0x1f595, 0x1f596}, {0x1f5a4, 0x1f5a4}, {0x1f5fb, 0x1f64f},
+    {0x1f680, 0x1f6c5}, {0x1f6cc, 0x1f6cc}, {0x1f6d0, 0x1f6d2},
+    {0x1f6d5, 0x1f6df}, {0x1f6eb, 0x1f6ec}, {0x1f6f4, 0x1f6fc},
+    {0x1f7e0, 0x1f7f0}, {0x1f90c, 0x1f93a}, {0x1f93c, 0x1f945},
+    {0x1f947, 0x1f9ff}, {0x1fa70, 0x1faf6}, {0x20000, 0x3134a}
+};
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+#define ZERO_WIDTH_ENTRIES (sizeof(ZERO_WIDTH) / sizeof(ZERO_WIDTH[0]))
+#define DOUBLE_WIDTH_ENTRIES (sizeof(DOUBLE_WIDTH) / sizeof(DOUBLE_WIDTH[0]))
+
+int utf8IsAscii(const char *s, int len) {
+    const char *end = s + len;
+    while (end - s >= 32) {
+        uint64_t w[4];
+        memcpy(w, s, sizeof(w));
+        if ((w[0] | w[1] | w[2] | w[3]) & 0x8080808080808080ULL)
+            return 0;
+        s += 32;
+    }
+    for (; s < end; s++)
+        if (*s & 0x80)
+            return 0;
+    return 1;
+}
 
-    E.numrows++;
-    E.dirty++;
+int utf8Decode(const char *s, int len, unsigned int *cp) {
+    unsigned char c = s[0];
+    int n, j;
+    if (c < 0x80) {
+        *cp = c;
+        return 1;
+    } else if (c >= 0xc2 && c <= 0xdf) {
+        n = 2;
+        *cp = c & 0x1f;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        n = 3;
+        *cp = c & 0x0f;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        n = 4;
+        *cp = c & 0x07;
+    } else {
+        return 0;
+    }
+    if (n > len)
+        return 0;
+    for (j = 1; j < n; j++) {
+        if ((s[j] & 0xc0) != 0x80)
+            return 0;
+        *cp = (*cp << 6) | (s[j] & 0x3f);
+    }
+    if ((n == 3 && (*cp < 0x800 || (*cp >= 0xd800 && *cp <= 0xdfff))) ||
+        (n == 4 && (*cp < 0x10000 || *cp > 0x10ffff)))
+        return 0;
+    return n;
 }
 
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+int utf8InTable(struct widthRange *t, int n, unsigned int cp) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (t[mid].hi < cp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < n && t[lo].lo <= cp;
 }
 
-void editorDelRow(int at) {
-    if (at < 0 || at >= E.numrows)
+int utf8Width(unsigned int cp) {
+    if (cp < ZERO_WIDTH[0].lo)
+        return 1;
+    if (utf8InTable(ZERO_WIDTH, ZERO_WIDTH_ENTRIES, cp))
+        return 0;
+    if (utf8InTable(DOUBLE_WIDTH, DOUBLE_WIDTH_ENTRIES, cp))
+        return 2;
+    return 1;
+}
+
+/*** syntax highlighting ***/
+
+int is_separator(int c) {
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+struct kwTrie *kwCompile(char **keywords) {
+    struct kwTrie *kw = calloc(1, sizeof(struct kwTrie));
+    int maxstates = 2;
+    int j, k;
+
+    kw->nclass = 1;
+    for (j = 0; keywords[j]; j++) {
+        int klen = strlen(keywords[j]);
+        if (klen && keywords[j][klen - 1] == '|')
+            klen--;
+        for (k = 0; k < klen; k++) {
+            unsigned char c = keywords[j][k];
+            if (!kw->cls[c])
+                kw->cls[c] = kw->nclass++;
+        }
+        maxstates += klen;
+    }
+
+    kw->next = calloc(maxstates * kw->nclass, sizeof(unsigned short));
+    kw->hl = calloc(maxstates, 1);
+    kw->prio = calloc(maxstates, sizeof(unsigned short));
+    kw->nstates = 2;
+
+    for (j = 0; keywords[j]; j++) {
+        int klen = strlen(keywords[j]);
+        int kw2 = klen && keywords[j][klen - 1] == '|';
+        if (kw2)
+            klen--;
+
+        int state = 1;
+        for (k = 0; k < klen; k++) {
+            unsigned short *t = &kw->next[state * kw->nclass +
+                                          kw->cls[(unsigned char)keywords[j][k]]];
+            if (!*t)
+                *t = kw->nstates++;
+            state = *t;
+        }
+        if (kw->hl[state] == HL_NORMAL) {
+            kw->hl[state] = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+            kw->prio[state] = j;
+        }
+    }
+    return kw;
+}
+
+int kwMatch(struct kwTrie *kw, char *s, int len, int *klen) {
+    int state = 1;
+    int best = HL_NORMAL;
+    int bestprio = 0;
+    int k = 0;
+
+    while (1) {
+        if (kw->hl[state] != HL_NORMAL && (k >= len || is_separator(s[k])) &&
+            (best == HL_NORMAL || kw->prio[state] < bestprio)) {
+            best = kw->hl[state];
+            bestprio = kw->prio[state];
+            *klen = k;
+        }
+        if (k >= len)
+            break;
+        int c = kw->cls[(unsigned char)s[k]];
+        if (!c)
+            break;
+        state = kw->next[state * kw->nclass + c];
+        if (!state)
+            break;
+        k++;
+    }
+    return best;
+}
+
+int editorSyntaxResume(struct editorSyntax *syntax, char *s, int len,
+                       unsigned char *hl, int in_comment, int i,
+                       unsigned char *old, int oldat, int oldlen, int *end) {
+    if (end)
+        *end = len;
+    if (syntax == NULL) {
+        if (hl)
+            memset(&hl[i], HL_NORMAL, len - i);
+        return 0;
+    }
+
+    char *scs = syntax->singleline_comment_start;
+    char *mcs = syntax->multiline_comment_start;
+    char *mce = syntax->multiline_comment_end;
+
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    int prev_sep = 1;
+    int in_string = 0;
+
+    while (i < len) {
+        if (prev_sep && !in_string && !in_comment && i > oldat &&
+            i - 1 - oldat < oldlen && old[i - 1 - oldat] == HL_NORMAL &&
+            is_separator(s[i - 1])) {
+            *end = i;
+            return -1;
+        }
+
+        char c = s[i];
+        unsigned char prev_hl = (hl && i > 0) ? hl[i - 1] : HL_NORMAL;
+
+        if (scs_len && !in_string && !in_comment) {
+            if (i + scs_len <= len && !memcmp(&s[i], scs, scs_len)) {
+                if (hl)
+                    memset(&hl[i], HL_COMMENT, len - i);
+                break;
+            }
+        }
+
+        if (mcs_len && mce_len && !in_string) {
+            if (in_comment) {
+                if (hl)
+                    hl[i] = HL_MLCOMMENT;
+                if (i + mce_len <= len && !memcmp(&s[i], mce, mce_len)) {
+                    if (hl)
+                        memset(&hl[i], HL_MLCOMMENT, mce_len);
+                    i += mce_len;
+                    in_comment = 0;
+                    prev_sep = 1;
+                    continue;
+                } else {
+                    i++;
+                    continue;
+                }
+            } else if (i + mcs_len <= len && !memcmp(&s[i], mcs, mcs_len)) {
+                if (hl)
+                    memset(&hl[i], HL_MLCOMMENT, mcs_len);
+                i += mcs_len;
+                in_comment = 1;
+                continue;
+            }
+        }
+
+        if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
+            if (in_string) {
+                if (hl)
+                    hl[i] = HL_STRING;
+                if (c == '\\' && i + 1 < len) {
+                    if (hl)
+                        hl[i + 1] = HL_STRING;
+                    i += 2;
+                    continue;
+                }
+                if (c == in_string)
+                    in_string = 0;
+                i++;
+                prev_sep = 1;
+                continue;
+            } else {
+                if (c == '"' || c == '\'') {
+                    in_string = c;
+                    if (hl)
+                        hl[i] = HL_STRING;
+                    i++;
+                    continue;
+                }
+            }
+        }
+
+        if (hl == NULL) {
+            i++;
+            continue;
+        }
+
+        if (syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+            if (isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) {
+                hl[i] = HL_NUMBER;
+                i++;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        if (prev_sep) {
+            int klen;
+            int kwhl = kwMatch(syntax->kw, &s[i], len - i, &klen);
+            if (kwhl != HL_NORMAL) {
+                memset(&hl[i], kwhl, klen);
+                i += klen;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        hl[i] = HL_NORMAL;
+        prev_sep = is_separator(c);
+        i++;
+    }
+
+    return in_comment;
+}
+
+int editorSyntaxLine(char *s, int len, unsigned char *hl, int in_comment) {
+    return editorSyntaxResume(E.syntax, s, len, hl, in_comment, 0, NULL, 0, 0,
+                              NULL);
+}
+
+void editorInvalidateSyntax(int at, int shifted) {
+    int k = at / HL_CHECKPOINT + 1;
+    E.hlversion++;
+    if (shifted) {
+        if (E.hlchecks > k)
+            E.hlchecks = k;
+        E.hlcheckn = E.hlchecks;
+    } else if (k < E.hlchecks) {
+        E.hlcheckn = E.hlchecks;
+        E.hlchecks = k;
+    } else if (k > E.hlchecks && E.hlcheckn > k) {
+        E.hlcheckn = k;
+    }
+    if (E.hlcache_line > at)
+        E.hlcache_line = -1;
+}
+
+void editorSyntaxCheckpoint(int line, int state) {
+    int k = line / HL_CHECKPOINT;
+    if (line % HL_CHECKPOINT != 0 || k != E.hlchecks)
         return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for (int j = at; j < E.numrows - 1; j++)
-        E.row[j].idx--;
-    E.numrows--;
-    E.dirty++;
+
+    if (k < E.hlcheckn && E.hlcheck[k] == state) {
+        E.hlchecks = E.hlcheckn;
+        return;
+    }
+    if (k == E.hlcheckcap) {
+        E.hlcheckcap *= 2;
+        E.hlcheck = realloc(E.hlcheck, E.hlcheckcap);
+    }
+    E.hlcheck[k] = state;
+    E.hlchecks = k + 1;
+    if (E.hlcheckn < E.hlchecks)
+        E.hlcheckn = E.hlchecks;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-    if (at < 0 || at > row->size)
-        at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at * 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+int editorSyntaxMultiline() {
+    return E.syntax && E.syntax->multiline_comment_start &&
+           E.syntax->multiline_comment_end;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+int editorSyntaxScanFrom(int at, int *state) {
+    int k = at / HL_CHECKPOINT;
+    if (k >= E.hlchecks)
+        k = E.hlchecks - 1;
+    if (E.hlcache_line > k * HL_CHECKPOINT && E.hlcache_line <= at) {
+        *state = E.hlcache_state;
+        return E.hlcache_line;
+    }
+    *state = E.hlcheck[k];
+    return k * HL_CHECKPOINT;
 }
 
-void editorRowDelChar(erow *row, int at) {
-    if (at < 0 || at >= row->size)
+int editorSyntaxReady(int at) {
+    int state;
+    if (at <= 0 || !editorSyntaxMultiline() || at / HL_CHECKPOINT < E.hlchecks)
+        return 1;
+    return at - editorSyntaxScanFrom(at, &state) <= HL_SYNC_LINES;
+}
+
+int editorSyntaxStateAt(int at) {
+    if (at <= 0 || !editorSyntaxMultiline())
+        return 0;
+    if (at == E.hlcache_line)
+        return E.hlcache_state;
+
+    long start = profNow();
+    int state;
+    int line = editorSyntaxScanFrom(at, &state);
+
+    for (; line < at; line++) {
+        int len;
+        char *chars = editorRowChars(line, &len);
+        state = editorSyntaxLine(chars, len, NULL, state);
+        editorSyntaxCheckpoint(line + 1, state);
+    }
+
+    E.hlcache_line = at;
+    E.hlcache_state = state;
+    profAdd(PROF_SYNTAX, start);
+    return state;
+}
+
+void editorHlUnlink(erow *row) {
+    if (row->hl_prev)
+        row->hl_prev->hl_next = row->hl_next;
+    else if (E.hlhead == row)
+        E.hlhead = row->hl_next;
+    else
         return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+    if (row->hl_next)
+        row->hl_next->hl_prev = row->hl_prev;
+    else
+        E.hltail = row->hl_prev;
+    row->hl_prev = row->hl_next = NULL;
+    E.hlrows--;
 }
 
-/*** editor operations ***/
+void editorHlTouch(erow *row) {
+    if (E.hlhead == row)
+        return;
+    editorHlUnlink(row);
+    row->hl_next = E.hlhead;
+    if (E.hlhead)
+        E.hlhead->hl_prev = row;
+    else
+        E.hltail = row;
+    E.hlhead = row;
+    E.hlrows++;
+}
 
-void editorInsertChar(int c) {
-    if (E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
+void editorHlDrop(erow *row) {
+    editorHlUnlink(row);
+    slabFree(row->hl, row->hlcap);
+    row->hl = NULL;
+    row->hlspans = 0;
+    row->hlcap = 0;
+}
+
+void editorHlEvict(int keep) {
+    while (E.hlrows > keep)
+        editorHlDrop(E.hltail);
+}
+
+unsigned char *editorHlScratch(int len) {
+    if (len > E.hlbufcap) {
+        E.hlbufcap = len > E.hlbufcap * 2 ? len : E.hlbufcap * 2;
+        E.hlbuf = realloc(E.hlbuf, E.hlbufcap);
+        if (E.hlbuf == NULL)
+            die("realloc");
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    return E.hlbuf;
 }
 
-void editorInsertNewline() {
-    if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0);
+int editorHlSpanAt(erow *row, int x) {
+    int lo = 0, hi = row->hlspans;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if ((int)(row->hl[mid].start + row->hl[mid].len) <= x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void editorHlDecode(erow *row, unsigned char *hl, int from, int len) {
+    int k;
+    memset(hl, HL_NORMAL, len);
+    for (k = editorHlSpanAt(row, from);
+         k < row->hlspans && (int)row->hl[k].start < from + len; k++) {
+        int start = row->hl[k].start;
+        int end = start + row->hl[k].len;
+        if (start < from)
+            start = from;
+        if (end > from + len)
+            end = from + len;
+        memset(&hl[start - from], row->hl[k].hl, end - start);
+    }
+}
+
+void editorHlSplice(erow *row, unsigned char *hl, int p, int q, int oq) {
+    int a = editorHlSpanAt(row, p);
+    int b = editorHlSpanAt(row, oq);
+    int tail = row->hlspans - b;
+    int n = 0;
+    int i, k;
+    for (i = p; i < q; i++)
+        if (hl[i] != HL_NORMAL && (i == p || hl[i] != hl[i - 1]))
+            n++;
+
+    row->hl = slabRealloc(row->hl, &row->hlcap,
+                          (a + n + tail) * sizeof(struct hlSpan));
+    if (tail)
+        memmove(&row->hl[a + n], &row->hl[b], tail * sizeof(struct hlSpan));
+    row->hlspans = a + n + tail;
+    for (k = a + n; k < row->hlspans; k++)
+        row->hl[k].start += q - oq;
+
+    k = a;
+    i = p;
+    while (i < q) {
+        if (hl[i] == HL_NORMAL) {
+            i++;
+            continue;
+        }
+        int start = i++;
+        while (i < q && hl[i] == hl[start])
+            i++;
+        row->hl[k].start = start;
+        row->hl[k].len = i - start;
+        row->hl[k].hl = hl[start];
+        k++;
+    }
+}
+
+void editorHighlightRow(erow *row, int in_comment) {
+    long start = profNow();
+    unsigned char *hl = editorHlScratch(row->rsize + 1);
+    row->hl_in_comment = in_comment;
+    if (in_comment == HL_PENDING) {
+        memset(hl, HL_NORMAL, row->rsize);
+        row->hl_open_comment = HL_PENDING;
     } else {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        row->hl_open_comment =
+            editorSyntaxLine(row->render, row->rsize, hl, in_comment);
     }
-    E.cy++;
-    E.cx = 0;
+    row->hlspans = 0;
+    editorHlSplice(row, hl, 0, row->rsize, 0);
+    editorHlTouch(row);
+    profAdd(PROF_SYNTAX, start);
 }
 
-void editorDelChar() {
-    if (E.cy == E.numrows)
+int editorSyntaxStateNow(int at) {
+    if (!editorSyntaxReady(at)) {
+        E.hlwait = 1;
+        return HL_PENDING;
+    }
+    return editorSyntaxStateAt(at);
+}
+
+void editorUpdateSyntax(erow *row) {
+    editorHighlightRow(row, editorSyntaxStateNow(ropeIndexOf(row)));
+}
+
+int editorSyntaxPending() {
+    return editorSyntaxMultiline() && E.hlchecks * HL_CHECKPOINT < E.numrows;
+}
+
+void *editorSyntaxWorker(void *arg) {
+    int lens[HL_CHECKPOINT];
+    char *buf = NULL;
+    size_t cap = 0;
+    (void)arg;
+
+#ifdef SCHED_IDLE
+    struct sched_param sp;
+    memset(&sp, 0, sizeof(sp));
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+#endif
+
+    pthread_mutex_lock(&E.lock);
+    while (1) {
+        if (!editorSyntaxPending()) {
+            pthread_cond_wait(&E.hlcond, &E.lock);
+            continue;
+        }
+
+        struct editorSyntax *syntax = E.syntax;
+        unsigned long version = E.hlversion;
+        int k = E.hlchecks - 1;
+        int state = E.hlcheck[k];
+        size_t used = 0;
+        int j;
+        for (j = 0; j < HL_CHECKPOINT; j++) {
+            char *chars = editorRowChars(k * HL_CHECKPOINT + j, &lens[j]);
+            if (used + lens[j] > cap) {
+                cap = (used + lens[j]) * 2;
+                buf = realloc(buf, cap);
+            }
+            memcpy(&buf[used], chars, lens[j]);
+            used += lens[j];
+        }
+        pthread_mutex_unlock(&E.lock);
+
+        long start = profNow();
+        char *p = buf;
+        for (j = 0; j < HL_CHECKPOINT; j++) {
+            state = editorSyntaxResume(syntax, p, lens[j], NULL, state, 0, NULL,
+                                       0, 0, NULL);
+            p += lens[j];
+        }
+        long ns = profNow() - start;
+
+        pthread_mutex_lock(&E.lock);
+        profRecord(PROF_WORKER, ns);
+        if (version != E.hlversion)
+            continue;
+        editorSyntaxCheckpoint((k + 1) * HL_CHECKPOINT, state);
+        if (E.hlwait && editorSyntaxReady(E.rowoff)) {
+            E.hlwait = 0;
+            E.redraw = 1;
+            write(E.winchpipe[1], "", 1);
+        }
+    }
+    return NULL;
+}
+
+void editorHighlightRows(int from, int to) {
+    if (to > E.numrows)
+        to = E.numrows;
+    if (from >= to)
         return;
 
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0) {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
+    int state = editorSyntaxStateNow(from);
+    int at;
+    for (at = from; at < to; at++) {
+        erow *row = editorRowAt(at);
+        if (row->hl == NULL || row->hl_in_comment != state)
+            editorHighlightRow(row, state);
+        else
+            editorHlTouch(row);
+        state = row->hl_open_comment;
+    }
+    editorHlEvict(HL_CACHE_ROWS);
+}
+
+int editorSyntaxToColor(int hl) {
+    switch (hl) {
+    case HL_COMMENT:
+    case HL_MLCOMMENT:
+        return 36;
+    case HL_KEYWORD1:
+        return 33;
+    case HL_KEYWORD2:
+        return 32;
+    case HL_STRING:
+        return 35;
+    case HL_NUMBER:
+        return 31;
+    case HL_MATCH:
+        return 34;
+    default:
+        return 37;
+    }
+}
+
+void editorSelectSyntaxHighlight() {
+    E.syntax = NULL;
+    editorInvalidateSyntax(0, 1);
+    editorHlEvict(0);
+    if (E.filename == NULL)
+        return;
+
+    char *ext = strrchr(E.filename, '.');
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+        struct editorSyntax *s = &HLDB[j];
+        unsigned int i = 0;
+        while (s->filematch[i]) {
+            int is_ext = (s->filematch[i][0] == '.');
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+                (!is_ext && strstr(E.filename, s->filematch[i]))) {
+                E.syntax = s;
+                if (s->kw == NULL)
+                    s->kw = kwCompile(s->keywords);
+                editorInvalidateSyntax(0, 1);
+                editorHlEvict(0);
+                return;
+            }
+            i++;
+        }
+    }
+}
+
+/*** row operations ***/
+
+int editorRowStopsBefore(erow *row, int cx) {
+    int lo = 0, hi = row->nstops;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (row->stops[mid].cx < cx)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int editorStopRender(struct widthStop *s) {
+    return s->len == 1 ? s->width : s->len;
+}
+
+struct widthStop *editorRowStopAt(erow *row, int cx) {
+    int k = editorRowStopsBefore(row, cx + 1);
+    if (k == 0)
+        return NULL;
+    struct widthStop *s = &row->stops[k - 1];
+    return cx < s->cx + s->n * s->len ? s : NULL;
+}
+
+int editorRowCharStart(erow *row, int cx) {
+    struct widthStop *s = editorRowStopAt(row, cx);
+    return s ? s->cx + (cx - s->cx) / s->len * s->len : cx;
+}
+
+int editorRowCharEnd(erow *row, int cx) {
+    struct widthStop *s = editorRowStopAt(row, cx);
+    return s ? editorRowCharStart(row, cx) + s->len : cx + 1;
+}
+
+int editorRowCxToRx(erow *row, int cx) {
+    if (!row->rendercap)
+        return cx;
+    int k = editorRowStopsBefore(row, cx);
+    if (k == 0)
+        return cx;
+    struct widthStop *s = &row->stops[k - 1];
+    int i = (cx - s->cx) / s->len;
+    if (i > s->n)
+        i = s->n;
+    return s->rx + i * editorStopRender(s) + cx - s->cx - i * s->len;
+}
+
+int editorRowCxToCol(erow *row, int cx) {
+    int k = editorRowStopsBefore(row, cx);
+    if (k == 0)
+        return cx;
+    struct widthStop *s = &row->stops[k - 1];
+    int i = (cx - s->cx) / s->len;
+    if (i > s->n)
+        i = s->n;
+    return s->col + i * s->width + cx - s->cx - i * s->len;
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+    if (!row->rendercap)
+        return rx < row->size ? rx : row->size;
+    int lo = 0, hi = row->nstops;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (row->stops[mid].rx <= rx)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int cx = rx;
+    if (lo) {
+        struct widthStop *s = &row->stops[lo - 1];
+        int w = editorStopRender(s);
+        int i = (rx - s->rx) / w;
+        if (i >= s->n)
+            cx = s->cx + s->n * s->len + rx - s->rx - s->n * w;
+        else
+            cx = s->cx + i * s->len;
+    }
+    return cx < row->size ? cx : row->size;
+}
+
+int editorRowColToRx(erow *row, int col, int *start) {
+    int lo = 0, hi = row->nstops;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (row->stops[mid].col <= col)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *start = col;
+    if (lo == 0)
+        return col;
+    struct widthStop *s = &row->stops[lo - 1];
+    int end = s->col + s->n * s->width;
+    if (col >= end)
+        return s->rx + s->n * editorStopRender(s) + col - end;
+    if (s->len == 1)
+        return s->rx + col - s->col;
+    int i = (col - s->col) / s->width;
+    *start = s->col + i * s->width;
+    return s->rx + i * s->len;
+}
+
+int editorScanStops(char *s, int at, int end, int rx, int col) {
+    int n = 0;
+    while (at < end) {
+        unsigned int cp;
+        int len = 1, width;
+        if (s[at] == '\t') {
+            width = MARROW_TAB_STOP - col % MARROW_TAB_STOP;
+        } else if (!(s[at] & 0x80) ||
+                   (len = utf8Decode(&s[at], end - at, &cp)) == 0) {
+            at++;
+            rx++;
+            col++;
+            continue;
+        } else {
+            width = utf8Width(cp);
+        }
+
+        struct widthStop *last = n ? &E.stopbuf[n - 1] : NULL;
+        if (last && len > 1 && last->len == len && last->width == width &&
+            last->cx + last->n * len == at) {
+            last->n++;
+        } else {
+            if (n == E.stopbufcap) {
+                E.stopbufcap = E.stopbufcap ? E.stopbufcap * 2 : 64;
+                E.stopbuf = realloc(E.stopbuf,
+                                    E.stopbufcap * sizeof(struct widthStop));
+                if (E.stopbuf == NULL)
+                    die("realloc");
+            }
+            struct widthStop stop = {at, rx, col, 1, len, width};
+            E.stopbuf[n++] = stop;
+        }
+        at += len;
+        rx += len == 1 ? width : len;
+        col += width;
+    }
+    return n;
+}
+
+void editorRowIndexWidths(erow *row, int at, int oe, int ne, int rx, int col,
+                          int rshift, int cshift) {
+    int a = editorRowStopsBefore(row, at);
+    int b = editorRowStopsBefore(row, oe);
+    struct widthStop carry;
+    int hascarry = 0;
+    int k;
+
+    if (b > 0) {
+        struct widthStop *s = &row->stops[b - 1];
+        int skip = (oe - s->cx) / s->len;
+        if (skip < s->n) {
+            carry = *s;
+            carry.cx += skip * s->len;
+            carry.rx += skip * s->len;
+            carry.col += skip * s->width;
+            carry.n -= skip;
+            hascarry = 1;
+        }
+    }
+    if (a > 0) {
+        struct widthStop *s = &row->stops[a - 1];
+        if (s->cx + s->n * s->len > at)
+            s->n = (at - s->cx) / s->len;
+    }
+    for (k = a; k < b; k++)
+        if (row->stops[k].len == 1)
+            row->ntabs--;
+
+    int n = editorScanStops(row->chars, at, ne, rx, col);
+    struct widthStop *src = E.stopbuf;
+    if (n && a > 0) {
+        struct widthStop *s = &row->stops[a - 1];
+        if (src->len > 1 && s->len == src->len && s->width == src->width &&
+            s->cx + s->n * s->len == src->cx) {
+            s->n += src->n;
+            src++;
+            n--;
+        }
+    }
+
+    int tail = row->nstops - b;
+    row->nstops = a + n + hascarry + tail;
+    if (row->nstops)
+        row->stops = slabRealloc(row->stops, &row->stopscap,
+                                 row->nstops * sizeof(struct widthStop));
+    if (tail)
+        memmove(&row->stops[a + n + hascarry], &row->stops[b],
+                tail * sizeof(struct widthStop));
+    if (hascarry)
+        row->stops[a + n] = carry;
+    for (k = a + n; k < row->nstops; k++) {
+        row->stops[k].cx += ne - oe;
+        row->stops[k].rx += rshift;
+        row->stops[k].col += cshift;
+    }
+    for (k = 0; k < n; k++) {
+        row->stops[a + k] = src[k];
+        if (src[k].len == 1)
+            row->ntabs++;
+    }
+}
+
+int editorRenderWidth(char *s, int len, int rx, int *col) {
+    int j = 0;
+    while (j < len) {
+        unsigned int cp;
+        int n;
+        if (s[j] == '\t') {
+            int w = MARROW_TAB_STOP - *col % MARROW_TAB_STOP;
+            rx += w;
+            *col += w;
+            j++;
+        } else if (!(s[j] & 0x80) ||
+                   (n = utf8Decode(&s[j], len - j, &cp)) == 0) {
+            rx++;
+            (*col)++;
+            j++;
+        } else {
+            rx += n;
+            *col += utf8Width(cp);
+            j += n;
+        }
+    }
+    return rx;
+}
+
+void editorRenderInto(char *dst, char *s, int len, int col) {
+    int j = 0;
+    while (j < len) {
+        unsigned int cp;
+        int n;
+        if (s[j] == '\t') {
+            int w = MARROW_TAB_STOP - col % MARROW_TAB_STOP;
+            memset(dst, ' ', w);
+            dst += w;
+            col += w;
+            j++;
+        } else if (!(s[j] & 0x80) ||
+                   (n = utf8Decode(&s[j], len - j, &cp)) == 0) {
+            *dst++ = s[j++];
+            col++;
+        } else {
+            memcpy(dst, &s[j], n);
+            dst += n;
+            col += utf8Width(cp);
+            j += n;
+        }
+    }
+}
+
+void editorRenderRow(erow *row) {
+    int tabs = memchr(row->chars, '\t', row->size) != NULL;
+    row->nstops = 0;
+    row->ntabs = 0;
+    if (tabs || !utf8IsAscii(row->chars, row->size))
+        editorRowIndexWidths(row, 0, 0, row->size, 0, 0, 0, 0);
+    if (!row->nstops) {
+        slabFree(row->stops, row->stopscap);
+        row->stops = NULL;
+        row->stopscap = 0;
+    }
+
+    if (!tabs) {
+        if (row->rendercap)
+            slabFree(row->render, row->rendercap);
+        row->render = row->chars;
+        row->rendercap = 0;
+        row->rsize = row->size;
+        return;
+    }
+
+    int col = 0;
+    row->rsize = editorRenderWidth(row->chars, row->size, 0, &col);
+    if (!row->rendercap)
+        row->render = NULL;
+    row->render = slabRealloc(row->render, &row->rendercap, row->rsize + 1);
+    editorRenderInto(row->render, row->chars, row->size, 0);
+    row->render[row->rsize] = '\0';
+}
+
+void editorUpdateRow(erow *row) {
+    editorRenderRow(row);
+    editorInvalidateSyntax(ropeIndexOf(row), 0);
+    editorUpdateSyntax(row);
+}
+
+void editorRowResyntax(erow *row, int rx0, int or, int nr) {
+    int idx = ropeIndexOf(row);
+    editorInvalidateSyntax(idx, 0);
+    if (row->hl == NULL)
+        return;
+
+    int in_comment = editorSyntaxStateNow(idx);
+    if (in_comment != row->hl_in_comment || in_comment == HL_PENDING) {
+        editorHighlightRow(row, in_comment);
+        return;
+    }
+    if (E.syntax == NULL) {
+        editorHlTouch(row);
+        return;
+    }
+
+    int delim = 1;
+    if (E.syntax && E.syntax->singleline_comment_start &&
+        (int)strlen(E.syntax->singleline_comment_start) > delim)
+        delim = strlen(E.syntax->singleline_comment_start);
+    if (E.syntax && E.syntax->multiline_comment_start &&
+        (int)strlen(E.syntax->multiline_comment_start) > delim)
+        delim = strlen(E.syntax->multiline_comment_start);
+
+    long start = profNow();
+    int p = rx0 + 1 - delim;
+    while (p > 0) {
+        int k = editorHlSpanAt(row, p - 1);
+        if (k < row->hlspans && (int)row->hl[k].start < p)
+            p = row->hl[k].start;
+        else if (is_separator(row->render[p - 1]))
+            break;
+        else
+            p--;
+    }
+    if (p < 0)
+        p = 0;
+
+    unsigned char old[HL_RESYNC];
+    int oldlen = row->rsize - nr;
+    if (oldlen > HL_RESYNC)
+        oldlen = HL_RESYNC;
+    editorHlDecode(row, old, or, oldlen);
+
+    unsigned char *hl = editorHlScratch(row->rsize + 1);
+    if (p > 0)
+        hl[p - 1] = HL_NORMAL;
+    int q;
+    int open = editorSyntaxResume(E.syntax, row->render, row->rsize, hl,
+                                  p ? 0 : in_comment, p, old, nr, oldlen, &q);
+    if (open != -1)
+        row->hl_open_comment = open;
+    editorHlSplice(row, hl, p, q, q - nr + or);
+    editorHlTouch(row);
+    profAdd(PROF_SYNTAX, start);
+}
+
+void editorRowSpliceChars(erow *row, int at, int del, char *s, int ins) {
+    if (ins > del)
+        row->chars =
+            slabRealloc(row->chars, &row->charscap, row->size - del + ins + 1);
+    memmove(&row->chars[at + ins], &row->chars[at + del],
+            row->size - at - del + 1);
+    if (ins)
+        memcpy(&row->chars[at], s, ins);
+    row->size += ins - del;
+    if (del || ins)
+        row->mapline = -1;
+}
+
+void editorRowSplice(erow *row, int at, int del, char *s, int ins) {
+    undoSplice(row, at, del, s, ins);
+    int lo = editorRowCharStart(row, at);
+    int hi = at + del;
+    int j;
+    if (hi < row->size && editorRowCharStart(row, hi) != hi)
+        hi = editorRowCharEnd(row, hi);
+    for (j = 0; j < 3 && lo > 0 && (row->chars[lo - 1] & 0x80) &&
+                !editorRowStopAt(row, lo - 1);
+         j++)
+        lo--;
+    for (j = 0; j < 3 && hi < row->size && (row->chars[hi] & 0x80) &&
+                !editorRowStopAt(row, hi);
+         j++)
+        hi++;
+
+    int tab = ins && memchr(s, '\t', ins);
+    if (!row->rendercap && tab) {
+        editorRowSpliceChars(row, at, del, s, ins);
+        editorUpdateRow(row);
+        E.dirty++;
+        return;
+    }
+    if (!row->rendercap && !row->nstops && lo == at && hi == at + del &&
+        utf8IsAscii(s, ins)) {
+        editorRowSpliceChars(row, at, del, s, ins);
+        row->render = row->chars;
+        row->rsize = row->size;
+        editorRowResyntax(row, at, at + del, at + ins);
+        E.dirty++;
+        return;
+    }
+
+    int oe = hi;
+    if (row->rendercap) {
+        int k = editorRowStopsBefore(row, hi);
+        while (k < row->nstops && row->stops[k].len != 1)
+            k++;
+        oe = k < row->nstops ? row->stops[k].cx + 1 : row->size;
+    }
+    int rx0 = editorRowCxToRx(row, lo);
+    int col0 = editorRowCxToCol(row, lo);
+    int or = editorRowCxToRx(row, oe);
+    int oc = editorRowCxToCol(row, oe);
+
+    editorRowSpliceChars(row, at, del, s, ins);
+
+    int ne = oe - del + ins;
+    int nc = col0;
+    int nr = editorRenderWidth(&row->chars[lo], ne - lo, rx0, &nc);
+    editorRowIndexWidths(row, lo, oe, ne, rx0, col0, nr - or, nc - oc);
+
+    if (!row->rendercap) {
+        row->render = row->chars;
+        row->rsize = row->size;
+    } else {
+        int tail = row->rsize - or;
+        if (nr > or)
+            row->render =
+                slabRealloc(row->render, &row->rendercap, nr + tail + 1);
+        memmove(&row->render[nr], &row->render[or], tail + 1);
+        editorRenderInto(&row->render[rx0], &row->chars[lo], ne - lo, col0);
+        row->rsize = nr + tail;
+        if (!row->ntabs)
+            editorRenderRow(row);
+    }
+
+    editorRowResyntax(row, rx0, or, nr);
+    E.dirty++;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+    if (at < 0 || at > E.numrows)
+        return;
+    if (at < E.numrows)
+        editorRowAt(at);
+
+    E.numrows++;
+    editorInvalidateSyntax(at, 1);
+    editorUpdateRow(editorNewRow(at, s, len));
+    undoRows(at, 0, NULL, 0, 1);
+
+    E.dirty++;
+}
+
+void editorFreeRow(erow *row) {
+    editorHlDrop(row);
+    if (row->rendercap)
+        slabFree(row->render, row->rendercap);
+    slabFree(row->stops, row->stopscap);
+    slabFree(row->chars, row->charscap);
+}
+
+void editorDelRow(int at) {
+    if (at < 0 || at >= E.numrows)
+        return;
+    erow *row = editorRowAt(at);
+    undoRows(at, 1, row->chars, row->size, 0);
+    editorInvalidateSyntax(at, 1);
+    row = ropeDelete(&E.rows, at);
+    editorFreeRow(row);
+    free(row);
+    E.numrows--;
+    E.dirty++;
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+    if (at < 0 || at > row->size)
+        at = row->size;
+    char ch = c;
+    editorRowSplice(row, at, 0, &ch, 1);
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    editorRowSplice(row, row->size, 0, s, len);
+}
+
+void editorRowDelChar(erow *row, int at) {
+    if (at < 0 || at >= row->size)
+        return;
+    editorRowSplice(row, at, 1, NULL, 0);
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c) {
+    if (E.cy == E.numrows) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+    E.cx++;
+}
+
+void editorInsertNewline() {
+    if (E.cx == 0) {
+        editorInsertRow(E.cy, "", 0);
+    } else {
+        erow *row = editorRowAt(E.cy);
+        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        editorRowSplice(row, E.cx, row->size - E.cx, NULL, 0);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+void editorDelChar() {
+    if (E.cy == E.numrows)
+        return;
+    if (E.cx == 0 && E.cy == 0)
+        return;
+
+    erow *row = editorRowAt(E.cy);
+    if (E.cx > row->size)
+        E.cx = row->size;
+    if (E.cx > 0) {
+        int start = editorRowCharStart(row, E.cx - 1);
+        editorRowSplice(row, start, E.cx - start, NULL, 0);
+        E.cx = start;
+    } else {
+        erow *prev = editorRowAt(E.cy - 1);
+        E.cx = prev->size;
+        editorRowAppendString(prev, row->chars, row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+}
+
+void editorInsertText(char *s, size_t len) {
+    if (len == 0)
+        return;
+    if (E.cy == E.numrows)
+        editorInsertRow(E.numrows, "", 0);
+    if (E.cy + 1 < E.numrows)
+        editorRowAt(E.cy + 1);
+
+    int first = E.cy;
+    erow *head = editorRowAt(E.cy);
+    erow *row = head;
+    if (E.cx > row->size)
+        E.cx = row->size;
+    size_t headlen = row->size;
+    char *orig = malloc(headlen + 1);
+    memcpy(orig, row->chars, headlen);
+    size_t taillen = row->size - E.cx;
+    char *tail = &orig[E.cx];
+    row->size = E.cx;
+    row->mapline = -1;
+
+    size_t i = 0;
+    while (1) {
+        size_t j = i;
+        while (j < len && s[j] != '\r' && s[j] != '\n')
+            j++;
+
+        if (E.cy == first) {
+            row->chars = slabRealloc(row->chars, &row->charscap,
+                                     row->size + j - i + 1);
+            memcpy(&row->chars[row->size], &s[i], j - i);
+            row->size += j - i;
+            row->chars[row->size] = '\0';
+        } else {
+            row = editorNewRow(E.cy, &s[i], j - i);
+            E.numrows++;
+        }
+        E.cx = row->size;
+
+        if (j == len)
+            break;
+        if (s[j] == '\r' && j + 1 < len && s[j + 1] == '\n')
+            j++;
+        i = j + 1;
+        E.cy++;
+    }
+
+    row->chars =
+        slabRealloc(row->chars, &row->charscap, row->size + taillen + 1);
+    memcpy(&row->chars[row->size], tail, taillen);
+    row->size += taillen;
+    row->chars[row->size] = '\0';
+    undoRows(first, 1, orig, headlen, E.cy - first + 1);
+    free(orig);
+
+    if (E.cy > first) {
+        editorInvalidateSyntax(first, 1);
+        int at;
+        for (at = first + 1; at <= E.cy; at++)
+            editorRenderRow(editorPeekRow(at));
+    }
+    editorUpdateRow(head);
+    E.dirty++;
+}
+
+/*** undo ***/
+
+struct undoRec *undoAt(size_t off) {
+    return (struct undoRec *)&E.undo.buf[off];
+}
+
+size_t undoRecSize(size_t bytes) {
+    size_t n = sizeof(struct undoRec) + bytes;
+    return (n + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+}
+
+void undoClear() {
+    E.undo.start = E.undo.len = E.undo.pos = 0;
+    E.undo.last = UNDO_NONE;
+    E.undo.saved = 0;
+}
+
+void undoReserve(size_t need) {
+    if (E.undo.len + need <= E.undo.cap)
+        return;
+    while (E.undo.len + need > E.undo.cap)
+        E.undo.cap = E.undo.cap ? E.undo.cap * 2 : 4096;
+    E.undo.buf = realloc(E.undo.buf, E.undo.cap);
+}
+
+/* Drops whole groups from the front while the log is over UNDO_MAX_BYTES;
+ * the newest group is always kept. */
+void undoTrim() {
+    struct undoLog *u = &E.undo;
+    while (u->len - u->start > UNDO_MAX_BYTES &&
+           undoAt(u->start)->group != u->group) {
+        int group = undoAt(u->start)->group;
+        while (undoAt(u->start)->group == group)
+            u->start += undoAt(u->start)->size;
+    }
+    if (u->saved != UNDO_NONE && u->saved < u->start)
+        u->saved = UNDO_NONE;
+
+    if (u->start > u->len / 2) {
+        memmove(u->buf, &u->buf[u->start], u->len - u->start);
+        u->len -= u->start;
+        u->pos -= u->start;
+        if (u->last != UNDO_NONE)
+            u->last -= u->start;
+        if (u->saved != UNDO_NONE)
+            u->saved -= u->start;
+        u->start = 0;
+    }
+}
+
+void undoTruncate() {
+    if (E.undo.saved != UNDO_NONE && E.undo.saved > E.undo.pos)
+        E.undo.saved = UNDO_NONE;
+    E.undo.len = E.undo.pos;
+}
+
+struct undoRec *undoAppend(int kind, int line, size_t bytes) {
+    struct undoLog *u = &E.undo;
+    size_t size = undoRecSize(bytes);
+    undoTruncate();
+    undoReserve(size);
+
+    if (u->newgroup) {
+        u->group++;
+        u->newgroup = 0;
+    }
+    struct undoRec *r = undoAt(u->len);
+    memset(r, 0, sizeof(struct undoRec));
+    r->size = size;
+    r->prevsize = u->last == UNDO_NONE ? 0 : undoAt(u->last)->size;
+    r->kind = kind;
+    r->group = u->group;
+    r->typing = u->typing;
+    r->line = line;
+    r->cx = u->cx;
+    r->cy = u->cy;
+    r->acx = E.cx;
+    r->acy = E.cy;
+    u->last = u->len;
+    u->len += size;
+    u->pos = u->len;
+    return r;
+}
+
+/* Typing and deleting next to the previous splice extend it instead of
+ * adding a record. */
+int undoCoalesce(int line, int at, int del, char *s, int ins, char *old) {
+    struct undoLog *u = &E.undo;
+    if (u->last == UNDO_NONE || (del && ins))
+        return 0;
+    struct undoRec *r = undoAt(u->last);
+    if (r->kind != UNDO_SPLICE || r->line != line ||
+        (!(u->typing && r->typing) && (u->newgroup || r->group != u->group)))
+        return 0;
+
+    size_t n = del ? del : ins;
+    if (ins && !(!r->dellen && at == r->col + (int)r->inslen))
+        return 0;
+    if (del && !(!r->inslen && (at + del == r->col || at == r->col)))
+        return 0;
+
+    undoTruncate();
+    size_t size = undoRecSize(r->dellen + r->inslen + n);
+    u->len = u->last;
+    undoReserve(size);
+    u->len = u->pos = u->last + size;
+    r = undoAt(u->last);
+    char *data = (char *)(r + 1);
+    if (ins) {
+        memcpy(&data[r->inslen], s, n);
+        r->inslen += n;
+    } else if (at + del == r->col) {
+        memmove(&data[n], data, r->dellen);
+        memcpy(data, old, n);
+        r->dellen += n;
+        r->col = at;
+    } else {
+        memcpy(&data[r->dellen], old, n);
+        r->dellen += n;
+    }
+    r->size = size;
+    u->group = r->group;
+    u->newgroup = 0;
+    return 1;
+}
+
+void undoSplice(erow *row, int at, int del, char *s, int ins) {
+    if (E.undo.paused || (!del && !ins))
+        return;
+    int line = ropeIndexOf(row);
+    if (undoCoalesce(line, at, del, s, ins, &row->chars[at]))
+        return;
+
+    struct undoRec *r = undoAppend(UNDO_SPLICE, line, del + ins);
+    char *data = (char *)(r + 1);
+    r->col = at;
+    r->dellen = del;
+    r->inslen = ins;
+    memcpy(data, &row->chars[at], del);
+    if (ins)
+        memcpy(&data[del], s, ins);
+    undoTrim();
+}
+
+/* Records that delrows rows (del) at line were replaced by the insrows rows
+ * now there. */
+void undoRows(int line, int delrows, char *del, size_t dellen, int insrows) {
+    if (E.undo.paused)
+        return;
+    size_t inslen = insrows ? insrows - 1 : 0;
+    int j, len;
+    for (j = 0; j < insrows; j++) {
+        editorRowChars(line + j, &len);
+        inslen += len;
+    }
+
+    struct undoRec *r = undoAppend(UNDO_ROWS, line, dellen + inslen);
+    char *p = (char *)(r + 1);
+    r->delrows = delrows;
+    r->insrows = insrows;
+    r->dellen = dellen;
+    r->inslen = inslen;
+    if (dellen)
+        memcpy(p, del, dellen);
+    p += dellen;
+    for (j = 0; j < insrows; j++) {
+        char *chars = editorRowChars(line + j, &len);
+        if (j)
+            *p++ = '\n';
+        memcpy(p, chars, len);
+        p += len;
+    }
+    undoTrim();
+}
+
+void undoApply(struct undoRec *r, int redo) {
+    char *data = (char *)(r + 1);
+    char *add = redo ? &data[r->dellen] : data;
+    size_t addlen = redo ? r->inslen : r->dellen;
+    int j;
+
+    if (r->kind == UNDO_SPLICE) {
+        editorRowSplice(editorRowAt(r->line), r->col,
+                        redo ? r->dellen : r->inslen, add, addlen);
+        return;
+    }
+    int rm = redo ? r->delrows : r->insrows;
+    int addrows = redo ? r->insrows : r->delrows;
+    for (j = 0; j < rm; j++)
+        editorDelRow(r->line);
+    if (addrows == 0)
+        return;
+    if (r->line < E.numrows)
+        editorRowAt(r->line);
+    editorInvalidateSyntax(r->line, 1);
+    char *end = add + addlen;
+    for (j = 0; j < addrows; j++) {
+        char *nl = memchr(add, '\n', end - add);
+        if (nl == NULL)
+            nl = end;
+        editorRenderRow(editorNewRow(r->line + j, add, nl - add));
+        E.numrows++;
+        add = nl + 1;
+    }
+    E.dirty++;
+}
+
+void undoBegin() {
+    E.undo.newgroup = 1;
+    E.undo.typing = 0;
+    E.undo.cx = E.cx;
+    E.undo.cy = E.cy;
+}
+
+void undoEnd() {
+    if (E.undo.last == UNDO_NONE || E.undo.newgroup)
+        return;
+    struct undoRec *r = undoAt(E.undo.last);
+    r->acx = E.cx;
+    r->acy = E.cy;
+}
+
+void editorUndo() {
+    struct undoLog *u = &E.undo;
+    if (u->last == UNDO_NONE) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    int group = undoAt(u->last)->group;
+    u->paused++;
+    while (u->last != UNDO_NONE && undoAt(u->last)->group == group) {
+        struct undoRec *r = undoAt(u->last);
+        undoApply(r, 0);
+        E.cx = r->cx;
+        E.cy = r->cy;
+        u->pos = u->last;
+        u->last = u->last == u->start ? UNDO_NONE : u->last - r->prevsize;
+    }
+    u->paused--;
+    if (u->pos == u->saved)
+        E.dirty = 0;
+}
+
+void editorRedo() {
+    struct undoLog *u = &E.undo;
+    if (u->pos == u->len) {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    int group = undoAt(u->pos)->group;
+    u->paused++;
+    while (u->pos < u->len && undoAt(u->pos)->group == group) {
+        struct undoRec *r = undoAt(u->pos);
+        undoApply(r, 1);
+        E.cx = r->acx;
+        E.cy = r->acy;
+        u->last = u->pos;
+        u->pos += r->size;
+    }
+    u->paused--;
+    if (u->pos == u->saved)
+        E.dirty = 0;
+}
+
+/*** file i/o ***/
+
+struct loadChunk {
+    char *map;
+    size_t start;
+    size_t end;
+    size_t *off;
+    size_t lines;
+    pthread_t tid;
+};
+
+struct saveBuf {
+    int fd;
+    struct iovec iov[SAVE_IOV];
+    int n;
+    size_t bytes;
+};
+
+int editorSaveFlush(struct saveBuf *sb) {
+    struct iovec *iov = sb->iov;
+    int n = sb->n;
+    while (n > 0) {
+        ssize_t w = writev(sb->fd, iov, n);
+        if (w == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    sb->n = 0;
+    return 0;
+}
+
+int editorSaveAppend(struct saveBuf *sb, char *s, size_t len) {
+    if (len == 0)
+        return 0;
+    sb->bytes += len;
+    if (sb->n) {
+        struct iovec *last = &sb->iov[sb->n - 1];
+        if ((char *)last->iov_base + last->iov_len == s) {
+            last->iov_len += len;
+            return 0;
+        }
+    }
+    if (sb->n == SAVE_IOV && editorSaveFlush(sb) == -1)
+        return -1;
+    sb->iov[sb->n].iov_base = s;
+    sb->iov[sb->n].iov_len = len;
+    sb->n++;
+    return 0;
+}
+
+int editorSaveRows(struct saveBuf *sb) {
+    static char newline[] = "\n";
+    struct ropeNode *leaf;
+
+    for (leaf = ropeFirstLeaf(E.rows); leaf; leaf = ropeNextLeaf(leaf)) {
+        int j;
+        for (j = 0; j < leaf->n; j++) {
+            erow *row = leaf->u.row[j];
+            if (!row->maplines) {
+                if (editorSaveAppend(sb, row->chars, row->size) == -1 ||
+                    editorSaveAppend(sb, newline, 1) == -1)
+                    return -1;
+                continue;
+            }
+
+            int line;
+            for (line = row->mapline; line < row->mapline + row->maplines;
+                 line++) {
+                int len;
+                char *chars = editorMapLine(line, &len);
+                size_t end = chars + len - E.map;
+                int nl = end + 1 == E.mapoff[line + 1] && E.map[end] == '\n';
+                if (editorSaveAppend(sb, chars, len + nl) == -1)
+                    return -1;
+                if (!nl && editorSaveAppend(sb, newline, 1) == -1)
+                    return -1;
+            }
+        }
+    }
+    return editorSaveFlush(sb);
+}
+
+/* Runs on loader threads, so it calls the real allocator rather than the
+ * bench build's counting wrappers. */
+void *editorLoadChunk(void *arg) {
+    struct loadChunk *c = arg;
+    size_t cap = (c->end - c->start) / 64 + 16;
+    size_t n = 0;
+
+    c->off = (malloc)(sizeof(size_t) * cap);
+    if (c->start == 0)
+        c->off[n++] = 0;
+    if (c->start == c->end) {
+        c->lines = n;
+        return NULL;
+    }
+    char *p = &c->map[c->start];
+    char *end = &c->map[c->end];
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        p++;
+        if (n + 1 == cap) {
+            cap *= 2;
+            c->off = (realloc)(c->off, sizeof(size_t) * cap);
+        }
+        c->off[n++] = p - c->map;
+    }
+    c->lines = n;
+    return NULL;
+}
+
+void editorLoadParallel(struct loadChunk *c, int n) {
+    int j;
+    for (j = 1; j < n; j++)
+        if (pthread_create(&c[j].tid, NULL, editorLoadChunk, &c[j]) != 0)
+            die("pthread_create");
+    editorLoadChunk(&c[0]);
+    for (j = 1; j < n; j++)
+        pthread_join(c[j].tid, NULL);
+}
+
+int editorLoadThreads(size_t size) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n = size / LOAD_CHUNK + 1;
+    if (cpus < 1)
+        cpus = 1;
+    if (n > (size_t)cpus)
+        n = cpus;
+    if (n > LOAD_THREADS)
+        n = LOAD_THREADS;
+    return n;
+}
+
+size_t *editorIndexLines(char *map, size_t size, int *nlines) {
+    struct loadChunk chunk[LOAD_THREADS];
+    int nchunks = editorLoadThreads(size);
+    size_t *off;
+    size_t lines = 0;
+    int j;
+    for (j = 0; j < nchunks; j++) {
+        chunk[j].map = map;
+        chunk[j].start = size / nchunks * j;
+        chunk[j].end = size / nchunks * (j + 1);
+    }
+    chunk[nchunks - 1].end = size;
+    editorLoadParallel(chunk, nchunks);
+
+    if (nchunks == 1) {
+        off = chunk[0].off;
+        lines = chunk[0].lines;
+    } else {
+        for (j = 0; j < nchunks; j++)
+            lines += chunk[j].lines;
+        off = malloc(sizeof(size_t) * (lines + 1));
+        lines = 0;
+        for (j = 0; j < nchunks; j++) {
+            memcpy(&off[lines], chunk[j].off, sizeof(size_t) * chunk[j].lines);
+            lines += chunk[j].lines;
+            free(chunk[j].off);
+        }
+    }
+
+    int n = lines;
+    if (off[n - 1] == size)
+        n--;
+    off[n] = size;
+    *nlines = n;
+    return off;
+}
+
+int editorMapFile(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+        return -1;
+
+    char *map = NULL;
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+            return -1;
+    }
+
+    editorFreeRows();
+    if (E.mapcap)
+        free(E.map);
+    else if (E.map)
+        munmap(E.map, E.mapsize);
+    free(E.mapoff);
+    E.map = map;
+    E.mapsize = st.st_size;
+    E.mapcap = 0;
+    E.mapino = st.st_ino;
+    E.maptruncated = 0;
+    E.mapstale = 0;
+
+    int n;
+    E.mapoff = editorIndexLines(map, E.mapsize, &n);
+    E.maplines = n;
+    E.mapoffcap = n + 1;
+
+    if (n)
+        ropeInsert(&E.rows, 0, editorMapRun(0, n));
+    E.numrows = n;
+    return 0;
+}
+
+void editorLoadLine(char *s, size_t len) {
+    while (len > 0 && (s[len - 1] == '\n' || s[len - 1] == '\r'))
+        len--;
+    editorInsertRow(E.numrows, s, len);
+}
+
+void editorOpen(char *filename) {
+    free(E.filename);
+    E.filename = strdup(filename);
+    E.undo.paused++;
+    undoClear();
+
+    editorSelectSyntaxHighlight();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1 || fstat(fd, &E.disk) == -1)
+        die("open");
+    if (editorMapFile(fd) == 0) {
+        close(fd);
+        E.dirty = 0;
+        E.undo.paused--;
+        return;
+    }
+
+    size_t cap = LOAD_BLOCK;
+    size_t len = 0;
+    char *buf = malloc(cap);
+    ssize_t nread;
+    while ((nread = read(fd, &buf[len], cap - len)) > 0) {
+        char *p = buf;
+        char *end = &buf[len + nread];
+        char *nl;
+        while ((nl = memchr(p, '\n', end - p)) != NULL) {
+            editorLoadLine(p, nl - p);
+            p = nl + 1;
+        }
+        len = end - p;
+        memmove(buf, p, len);
+        if (len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+    }
+    if (nread == -1)
+        die("read");
+    if (len)
+        editorLoadLine(buf, len);
+    free(buf);
+    close(fd);
+    E.dirty = 0;
+    E.undo.paused--;
+}
+
+void editorStreamOpen() {
+    E.streamfd = dup(STDIN_FILENO);
+    int tty = open("/dev/tty", O_RDWR);
+    if (E.streamfd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1)
+        die("/dev/tty");
+    close(tty);
+
+    E.mapoffcap = 1024;
+    E.mapoff = malloc(sizeof(size_t) * E.mapoffcap);
+    E.mapoff[0] = 0;
+    E.maplines = 0;
+}
+
+void editorStreamLine(size_t end) {
+    if (E.maplines + 2 > E.mapoffcap) {
+        E.mapoffcap *= 2;
+        E.mapoff = realloc(E.mapoff, sizeof(size_t) * E.mapoffcap);
+    }
+    E.mapoff[++E.maplines] = end;
+}
+
+void editorStreamRead() {
+    if (E.mapsize + LOAD_BLOCK > E.mapcap) {
+        E.mapcap = E.mapcap ? E.mapcap * 2 : 2 * LOAD_BLOCK;
+        E.map = realloc(E.map, E.mapcap);
+    }
+
+    int first = E.maplines;
+    ssize_t nread = read(E.streamfd, &E.map[E.mapsize], E.mapcap - E.mapsize);
+    if (nread == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (nread > 0) {
+        char *p = &E.map[E.mapsize];
+        char *end = p + nread;
+        E.mapsize += nread;
+        while ((p = memchr(p, '\n', end - p)) != NULL) {
+            p++;
+            editorStreamLine(p - E.map);
+        }
+    } else {
+        if (E.mapsize > E.mapoff[E.maplines])
+            editorStreamLine(E.mapsize);
+        close(E.streamfd);
+        E.streamfd = -1;
+        if (nread == -1)
+            editorSetStatusMessage("Read error: %s", strerror(errno));
+    }
+
+    int n = E.maplines - first;
+    if (n) {
+        ropeInsert(&E.rows, E.numrows, editorMapRun(first, n));
+        E.numrows += n;
+    }
+}
+
+/*** disk ***/
+
+struct diffHunk {
+    int a, alen;
+    int b, blen;
+};
+
+uint64_t editorHashLine(char *s, int len) {
+    uint64_t h = 14695981039346656037ULL;
+    while (len--) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Myers' O(ND) diff. Marks deleted lines of a and inserted lines of b, or
+ * returns -1 when more edits are needed than DIFF_MAX_EDIT, or than keep the
+ * (N+M)D scan under DIFF_MAX_WORK. */
+int diffMyers(uint64_t *a, int n, uint64_t *b, int m, char *dela,
+              char *insb) {
+    int max = n + m < DIFF_MAX_EDIT ? n + m : DIFF_MAX_EDIT;
+    if (n + m > 0 && max > DIFF_MAX_WORK / (n + m))
+        max = DIFF_MAX_WORK / (n + m);
+    int *v = malloc(sizeof(int) * (2 * max + 3));
+    int **trace = malloc(sizeof(int *) * (max + 1));
+    int o = max + 1;
+    int d, k, found = -1;
+
+    v[o + 1] = 0;
+    for (d = 0; d <= max && found == -1; d++) {
+        for (k = -d; k <= d; k += 2) {
+            int x = (k == -d || (k != d && v[o + k - 1] < v[o + k + 1]))
+                        ? v[o + k + 1]
+                        : v[o + k - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && a[x] == b[y]) {
+                x++;
+                y++;
+            }
+            v[o + k] = x;
+            if (x >= n && y >= m)
+                found = d;
+        }
+        trace[d] = malloc(sizeof(int) * (2 * d + 1));
+        memcpy(trace[d], &v[o - d], sizeof(int) * (2 * d + 1));
+    }
+
+    if (found != -1) {
+        int x = n, y = m;
+        for (d = found; d > 0; d--) {
+            int *pv = trace[d - 1];
+            k = x - y;
+            int pk = (k == -d || (k != d && pv[k - 1 + d - 1] < pv[k + 1 + d - 1]))
+                         ? k + 1
+                         : k - 1;
+            int px = pv[pk + d - 1];
+            int py = px - pk;
+            if (pk == k + 1)
+                insb[py] = 1;
+            else
+                dela[px] = 1;
+            x = px;
+            y = py;
+        }
+    }
+
+    for (k = 0; k < d; k++)
+        free(trace[k]);
+    free(trace);
+    free(v);
+    return found;
+}
+
+int editorDiffMapLine(struct diffHunk *h, int nh, int line) {
+    int shift = 0;
+    int k;
+    for (k = 0; k < nh && line >= h[k].a; k++) {
+        if (line < h[k].a + h[k].alen) {
+            int d = line - h[k].a;
+            return h[k].b + (d < h[k].blen ? d : h[k].blen);
+        }
+        shift = h[k].b + h[k].blen - h[k].a - h[k].alen;
+    }
+    return line + shift;
+}
+
+/* Turns the rows into the m lines indexed by off, touching only the rows
+ * that differ. Lines are matched by hash and every kept pair is compared
+ * again. Returns the number of changed hunks, or -1 if the files are too
+ * different to be worth diffing or two lines only shared a hash. */
+int editorPatchRows(char *map, size_t *off, int m) {
+    int n = E.numrows;
+    int pre = 0, suf = 0;
+    int len, blen, i, j, k;
+    char *a, *b;
+
+    while (pre < n && pre < m) {
+        a = editorRowChars(pre, &len);
+        b = editorLineAt(map, off, pre, &blen);
+        if (len != blen || memcmp(a, b, len))
+            break;
+        pre++;
+    }
+    while (suf < n - pre && suf < m - pre) {
+        a = editorRowChars(n - 1 - suf, &len);
+        b = editorLineAt(map, off, m - 1 - suf, &blen);
+        if (len != blen || memcmp(a, b, len))
+            break;
+        suf++;
+    }
+
+    int na = n - pre - suf;
+    int nb = m - pre - suf;
+    uint64_t *ha = malloc(sizeof(uint64_t) * (na + 1));
+    uint64_t *hb = malloc(sizeof(uint64_t) * (nb + 1));
+    char *dela = calloc(na + 1, 1);
+    char *insb = calloc(nb + 1, 1);
+    for (i = 0; i < na; i++) {
+        a = editorRowChars(pre + i, &len);
+        ha[i] = editorHashLine(a, len);
+    }
+    for (j = 0; j < nb; j++) {
+        b = editorLineAt(map, off, pre + j, &blen);
+        hb[j] = editorHashLine(b, blen);
+    }
+    int d = diffMyers(ha, na, hb, nb, dela, insb);
+    free(ha);
+    free(hb);
+
+    struct diffHunk *h = NULL;
+    int nh = 0;
+    if (d != -1) {
+        h = malloc(sizeof(struct diffHunk) * (d + 1));
+        i = j = 0;
+        while (i < na || j < nb) {
+            if (i < na && j < nb && !dela[i] && !insb[j]) {
+                a = editorRowChars(pre + i, &len);
+                b = editorLineAt(map, off, pre + j, &blen);
+                if (len != blen || memcmp(a, b, len)) {
+                    d = -1;
+                    break;
+                }
+                i++;
+                j++;
+                continue;
+            }
+            h[nh].a = pre + i;
+            h[nh].b = pre + j;
+            while (i < na && dela[i])
+                i++;
+            while (j < nb && insb[j])
+                j++;
+            h[nh].alen = pre + i - h[nh].a;
+            h[nh].blen = pre + j - h[nh].b;
+            nh++;
+        }
+    }
+    free(dela);
+    free(insb);
+    if (d == -1) {
+        free(h);
+        return -1;
+    }
+
+    int cy = editorDiffMapLine(h, nh, E.cy);
+    int rowoff = editorDiffMapLine(h, nh, E.rowoff);
+    for (k = nh - 1; k >= 0; k--) {
+        for (i = 0; i < h[k].alen; i++)
+            editorDelRow(h[k].a);
+        for (j = 0; j < h[k].blen; j++) {
+            b = editorLineAt(map, off, h[k].b + j, &blen);
+            editorInsertRow(h[k].a + j, b, blen);
+        }
+    }
+    free(h);
+
+    E.cy = cy;
+    E.rowoff = rowoff;
+    if (E.cy < E.numrows && E.cx > editorRowAt(E.cy)->size)
+        E.cx = editorRowAt(E.cy)->size;
+    return nh;
+}
+
+int editorDiskChanged(struct stat *st) {
+#ifdef __APPLE__
+    struct timespec a = st->st_mtimespec, b = E.disk.st_mtimespec;
+#else
+    struct timespec a = st->st_mtim, b = E.disk.st_mtim;
+#endif
+    return st->st_ino != E.disk.st_ino || st->st_size != E.disk.st_size ||
+           a.tv_sec != b.tv_sec || a.tv_nsec != b.tv_nsec;
+}
+
+int editorHasMapRuns() {
+    struct ropeNode *leaf;
+    for (leaf = ropeFirstLeaf(E.rows); leaf; leaf = ropeNextLeaf(leaf)) {
+        int j;
+        for (j = 0; j < leaf->n; j++)
+            if (leaf->u.row[j]->maplines)
+                return 1;
+    }
+    return 0;
+}
+
+/* Rows not loaded yet are read from the mapping of inode E.mapino. Once that
+ * inode changes in place they show the other writer's bytes, so kept edits
+ * can only be saved under a new name (E.mapstale). */
+int editorMapStale(struct stat *st) {
+    return E.map && !E.mapcap && st->st_ino == E.mapino && editorHasMapRuns();
+}
+
+void editorReloadFull() {
+    char *path = strdup(E.filename);
+    editorOpen(path);
+    free(path);
+    if (E.cy > E.numrows)
+        E.cy = E.numrows;
+    E.cx = 0;
+    editorSetStatusMessage("Reloaded %s", E.filename);
+}
+
+void editorReload() {
+    struct stat st;
+    int fd = open(E.filename, O_RDONLY);
+    if (fd == -1)
+        return;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return;
+    }
+
+    if (editorMapStale(&st)) {
+        close(fd);
+        editorReloadFull();
+        return;
+    }
+
+    char *map = NULL;
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return;
+        }
+    }
+    close(fd);
+
+    int m;
+    size_t *off = editorIndexLines(map, st.st_size, &m);
+    E.undo.paused++;
+    int nh = editorPatchRows(map, off, m);
+    E.undo.paused--;
+    if (map)
+        munmap(map, st.st_size);
+    free(off);
+
+    if (nh == -1) {
+        editorReloadFull();
+        return;
+    }
+    E.disk = st;
+    E.dirty = 0;
+    undoClear();
+    editorSetStatusMessage("Reloaded %s (%d change%s)", E.filename, nh,
+                           nh == 1 ? "" : "s");
+}
+
+void editorDiskPrompt() {
+    struct stat st;
+    int stale =
+        E.maptruncated || (stat(E.filename, &st) == 0 && editorMapStale(&st));
+    char *answer = editorPrompt(
+        stale ? "File rewritten in place. Reload and discard your changes? "
+                "(y/n) %s"
+              : "File changed on disk. Reload and discard your changes? "
+                "(y/n) %s",
+        NULL);
+    E.diskchanged = 0;
+    if (answer && (answer[0] == 'y' || answer[0] == 'Y')) {
+        if (E.follow)
+            editorReloadFull();
+        else
+            editorReload();
+    } else {
+        if (stat(E.filename, &st) == 0) {
+            if (E.maptruncated || editorMapStale(&st))
+                E.mapstale = 1;
+            E.disk = st;
+        }
+        E.maptruncated = 0;
+        if (E.mapstale) {
+            E.follow = 0;
+            editorSetStatusMessage("Kept your changes; the file changed in "
+                                   "place, so save them under a new name");
+        } else if (E.follow) {
+            E.follow = 0;
+            editorSetStatusMessage("Kept your changes and stopped following; "
+                                   "saving will overwrite the file on disk");
+        } else {
+            editorSetStatusMessage("Kept your changes; saving will overwrite "
+                                   "the file on disk");
+        }
+    }
+    free(answer);
+}
+
+/* Follow mode: appended bytes are indexed from the old end of the mapping;
+ * a shrunk or replaced file is reloaded. A loaded row keeps the mapping line
+ * it came from in mapline until it is edited, which is how the rows of the
+ * file are told apart from rows typed below them. */
+
+int editorLastMapRow(int *line) {
+    int at;
+    for (at = E.numrows - 1; at >= 0; at--) {
+        int off;
+        erow *row = ropeAt(E.rows, at, &off);
+        if (row->maplines || row->mapline != -1) {
+            *line = row->mapline + off;
+            return at;
+        }
+    }
+    return -1;
+}
+
+void editorFollowAppend(size_t size) {
+    int fd = open(E.filename, O_RDONLY);
+    if (fd == -1)
+        return;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    int tail = E.cy >= E.numrows - 1;
+    int line;
+    int at = editorLastMapRow(&line);
+    int partial = 0;
+    if (at == -1 || line != E.maplines - 1) {
+        at = E.numrows;
+    } else if (E.mapoff[E.maplines] == E.mapsize &&
+               E.map[E.mapsize - 1] != '\n') {
+        int dirty = E.dirty;
+        E.undo.paused++;
+        editorDelRow(at);
+        E.undo.paused--;
+        E.dirty = dirty;
+        E.maplines--;
+        partial = 1;
+    } else {
+        at++;
+    }
+    if (E.map)
+        munmap(E.map, E.mapsize);
+    E.map = map;
+    E.mapsize = size;
+
+    int first = E.maplines;
+    char *p = &E.map[E.mapoff[first]];
+    char *end = &E.map[size];
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        p++;
+        editorStreamLine(p - E.map);
+    }
+    if (size > E.mapoff[E.maplines])
+        editorStreamLine(size);
+
+    int n = E.maplines - first;
+    if (n) {
+        if (at < E.numrows) {
+            editorInvalidateSyntax(at, 1);
+            if (n != partial)
+                undoClear();
+        }
+        ropeInsert(&E.rows, at, editorMapRun(first, n));
+        E.numrows += n;
+    }
+    if (tail && at + n == E.numrows) {
+        E.cy = E.numrows - 1;
+        E.cx = 0;
+    } else if (E.cy >= at + partial) {
+        E.cy += n - partial;
+    }
+}
+
+void editorWatchStart() {
+    struct stat st;
+    if (stat(E.filename, &st) == -1 || !S_ISREG(st.st_mode)) {
+        if (E.follow)
+            editorSetStatusMessage("Can only follow regular files");
+        E.follow = 0;
+        return;
+    }
+#ifdef __linux__
+    E.watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (E.watchfd == -1)
+        die("inotify_init1");
+
+    char *dir = strdup(E.filename);
+    char *slash = strrchr(dir, '/');
+    if (slash)
+        slash[slash == dir] = '\0';
+    inotify_add_watch(E.watchfd, slash ? dir : ".", IN_CREATE | IN_MOVED_TO);
+    free(dir);
+    E.watchwd = -1;
+    E.watchino = 0;
+    editorWatchCheck();
+#else
+    if (E.follow)
+        editorSetStatusMessage("Follow mode needs inotify");
+    E.follow = 0;
+#endif
+}
+
+void editorWatchCheck() {
+    struct stat st;
+    if (stat(E.filename, &st) == -1)
+        return;
+#ifdef __linux__
+    if (st.st_ino != E.watchino) {
+        if (E.watchwd != -1)
+            inotify_rm_watch(E.watchfd, E.watchwd);
+        E.watchwd = inotify_add_watch(E.watchfd, E.filename,
+                                      IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF |
+                                          IN_DELETE_SELF);
+        E.watchino = st.st_ino;
+    }
+#endif
+    if (editorDiskChanged(&st) || E.maptruncated)
+        E.diskchanged = 1;
+}
+
+/* Applies a change the watcher recorded. It runs from the key loop, never
+ * inside a prompt or a paste, since a reload replaces the rows under them. */
+void editorDiskEvent() {
+    struct stat st;
+    if (stat(E.filename, &st) == -1)
+        return;
+    if (E.mapstale && !editorDiskChanged(&st))
+        E.maptruncated = 0;
+    if (!editorDiskChanged(&st) && !E.maptruncated)
+        return;
+
+    if (E.follow && !E.maptruncated && st.st_ino == E.disk.st_ino &&
+        (size_t)st.st_size >= E.mapsize) {
+        if ((size_t)st.st_size > E.mapsize)
+            editorFollowAppend(st.st_size);
+        E.disk = st;
+    } else if (E.dirty) {
+        editorDiskPrompt();
+    } else if (E.follow) {
+        editorReloadFull();
+    } else {
+        editorReload();
+    }
+    E.redraw = 1;
+}
+
+int editorSaveAtomic(struct saveBuf *sb, char *target, char *tmp) {
+    sb->fd = mkstemp(tmp);
+    if (sb->fd == -1)
+        return -1;
+
+    struct stat st;
+    if (stat(target, &st) == 0) {
+        fchown(sb->fd, st.st_uid, st.st_gid);
+        fchmod(sb->fd, st.st_mode & 07777);
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(sb->fd, 0644 & ~mask);
+    }
+
+    if (editorSaveRows(sb) == -1 || fsync(sb->fd) == -1 ||
+        rename(tmp, target) == -1) {
+        int saved_errno = errno;
+        close(sb->fd);
+        unlink(tmp);
+        errno = saved_errno;
+        return -1;
+    }
+
+    int dirfd;
+    char *slash = strrchr(target, '/');
+    if (slash) {
+        *slash = '\0';
+        dirfd = open(*target ? target : "/", O_RDONLY);
+        *slash = '/';
+    } else {
+        dirfd = open(".", O_RDONLY);
+    }
+    if (dirfd != -1) {
+        fsync(dirfd);
+        close(dirfd);
+    }
+
+    if (E.map && !E.mapcap)
+        editorMapFile(sb->fd);
+    close(sb->fd);
+    return 0;
+}
+
+void editorSave() {
+    struct stat st;
+    if (E.filename && stat(E.filename, &st) == 0 &&
+        (E.maptruncated || (editorDiskChanged(&st) && editorMapStale(&st))))
+        E.mapstale = 1;
+
+    if (E.filename == NULL || E.mapstale) {
+        char *name = editorPrompt(
+            E.mapstale ? "File changed in place; save as: %s (ESC to cancel)"
+                       : "Save as: %s (ESC to cancel)",
+            NULL);
+        if (name == NULL) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        if (E.mapstale && stat(name, &st) == 0 && st.st_ino == E.mapino) {
+            free(name);
+            editorSetStatusMessage("Save aborted; that is the file that "
+                                   "changed, pick another name");
+            return;
+        }
+        free(E.filename);
+        E.filename = name;
+        editorSelectSyntaxHighlight();
+        E.follow = 0;
+        if (E.watchfd != -1) {
+            close(E.watchfd);
+            E.watchfd = -1;
+        }
+    }
+
+    if (E.disk.st_ino && stat(E.filename, &st) == 0 && editorDiskChanged(&st)) {
+        char *answer =
+            editorPrompt("File changed on disk. Overwrite it? (y/n) %s", NULL);
+        int overwrite = answer && (answer[0] == 'y' || answer[0] == 'Y');
+        free(answer);
+        if (!overwrite) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    char *target = realpath(E.filename, NULL);
+    if (target == NULL)
+        target = strdup(E.filename);
+    char *base = strrchr(target, '/');
+    int dirlen = base ? base - target + 1 : 0;
+    char *tmp = malloc(strlen(target) + 16);
+    sprintf(tmp, "%.*s.%s.XXXXXX", dirlen, target, target + dirlen);
+
+    struct saveBuf *sb = malloc(sizeof(struct saveBuf));
+    sb->n = 0;
+    sb->bytes = 0;
+    if (editorSaveAtomic(sb, target, tmp) == 0) {
+        E.dirty = 0;
+        E.undo.saved = E.undo.pos;
+        stat(E.filename, &E.disk);
+        E.diskchanged = 0;
+        if (E.watchfd == -1)
+            editorWatchStart();
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double ms =
+            (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+        editorSetStatusMessage(
+            "%zu bytes written to disk in %.1f ms (%.1f MB/s)", sb->bytes, ms,
+            ms > 0 ? sb->bytes / (ms * 1e3) : 0.0);
     } else {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
     }
+    free(sb);
+    free(tmp);
+    free(target);
 }
 
-/*** file i/o ***/
+/*** find ***/
 
-char *editorRowsToString(int *buflen) {
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numrows; j++)
-        totlen += E.row[j].size + 1;
-    *buflen = totlen;
-
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+int editorFindAdd(int line, int col) {
+    struct findIndex *f = &E.find;
+    if (f->n == FIND_MAX_MATCHES) {
+        f->truncated = 1;
+        return 0;
     }
-
-    return buf;
+    if (f->n == f->cap) {
+        f->cap = f->cap ? f->cap * 2 : 64;
+        f->m = realloc(f->m, sizeof(struct findMatch) * f->cap);
+    }
+    f->m[f->n].line = line;
+    f->m[f->n].col = col;
+    f->n++;
+    return 1;
 }
 
-void editorOpen(char *filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
+int editorMapLineOf(size_t off, int lo, int hi) {
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        if (E.mapoff[mid] <= off)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-    editorSelectSyntaxHighlight();
+void editorFindScan(char *query, int qlen) {
+    struct ropeNode *leaf;
+    int line = 0;
+
+    E.find.n = 0;
+    E.find.truncated = 0;
+    for (leaf = ropeFirstLeaf(E.rows); leaf; leaf = ropeNextLeaf(leaf)) {
+        int j;
+        for (j = 0; j < leaf->n; j++) {
+            erow *row = leaf->u.row[j];
+            char *base = row->chars;
+            char *end = row->chars + row->size;
+            if (row->maplines) {
+                base = &E.map[E.mapoff[row->mapline]];
+                end = &E.map[E.mapoff[row->mapline + row->maplines]];
+            }
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
-        die("fopen");
-
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 &&
-               (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-            linelen--;
-        editorInsertRow(E.numrows, line, linelen);
-    }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+            char *p = base;
+            while ((p = memmem(p, end - p, query, qlen)) != NULL) {
+                int l = 0;
+                int col = p - base;
+                if (row->maplines) {
+                    size_t off = p - E.map;
+                    l = editorMapLineOf(off, row->mapline,
+                                        row->mapline + row->maplines);
+                    col = off - E.mapoff[l];
+                    l -= row->mapline;
+                }
+                if (!editorFindAdd(line + l, col))
+                    return;
+                p++;
+            }
+            line += ropeWeight(row);
+        }
+    }
 }
 
-void editorSave() {
-    if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL) {
-            editorSetStatusMessage("Save aborted");
-            return;
-        }
-        editorSelectSyntaxHighlight();
+void editorFindRefine(char *query, int qlen) {
+    struct findIndex *f = &E.find;
+    int j, k = 0;
+    for (j = 0; j < f->n; j++) {
+        int len;
+        char *chars = editorRowChars(f->m[j].line, &len);
+        if (f->m[j].col + qlen <= len &&
+            !memcmp(&chars[f->m[j].col], query, qlen))
+            f->m[k++] = f->m[j];
     }
+    f->n = k;
+}
 
-    int len;
-    char *buf = editorRowsToString(&len);
-
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
-        }
-        close(fd);
+int editorFindNearest(int line, int col) {
+    struct findIndex *f = &E.find;
+    int lo = 0, hi = f->n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (f->m[mid].line < line ||
+            (f->m[mid].line == line && f->m[mid].col < col))
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    return lo == f->n ? 0 : lo;
 }
 
-/*** find ***/
 void editorFindCallback(char *query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
-
     static int saved_hl_line;
-    static char *saved_hl = NULL;
+    static int saved_hlspans;
+    static struct hlSpan *saved_hl = NULL;
+    struct findIndex *f = &E.find;
 
     if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
+        erow *row = editorRowAt(saved_hl_line);
+        if (row->hl) {
+            row->hl = slabRealloc(row->hl, &row->hlcap,
+                                  saved_hlspans * sizeof(struct hlSpan));
+            memcpy(row->hl, saved_hl, saved_hlspans * sizeof(struct hlSpan));
+            row->hlspans = saved_hlspans;
+        }
         free(saved_hl);
         saved_hl = NULL;
     }
 
     if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
+        f->active = 0;
         return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
+    }
+
+    int qlen = strlen(query);
+    if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        if (f->n)
+            f->cur = (f->cur + 1) % f->n;
     } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
-    } else {
-        last_match = -1;
-        direction = 1;
-    }
-
-    if (last_match == -1)
-        direction = 1;
-    int current = last_match;
-    int i;
-    for (i = 0; i < E.numrows; i++) {
-        current += direction;
-        if (current == -1)
-            current = E.numrows - 1;
-        else if (current == E.numrows)
-            current = 0;
-
-        erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.numrows;
-
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
+        if (f->n)
+            f->cur = (f->cur + f->n - 1) % f->n;
+    } else if (qlen != f->qlen || (qlen && strcmp(query, f->query))) {
+        if (qlen == 0)
+            f->n = 0;
+        else if (f->qlen && qlen > f->qlen && !f->truncated &&
+                 !strncmp(query, f->query, f->qlen))
+            editorFindRefine(query, qlen);
+        else
+            editorFindScan(query, qlen);
+
+        free(f->query);
+        f->query = strdup(query);
+        f->qlen = qlen;
+        f->cur = editorFindNearest(f->origin_line, f->origin_col);
     }
+
+    if (f->n == 0)
+        return;
+
+    struct findMatch *match = &f->m[f->cur];
+    erow *row = editorRowAt(match->line);
+    if (row->hl == NULL)
+        editorUpdateSyntax(row);
+    E.cy = match->line;
+    E.cx = match->col;
+    E.rowoff = E.numrows;
+
+    int rx = editorRowCxToRx(row, match->col);
+    saved_hl_line = match->line;
+    saved_hlspans = row->hlspans;
+    saved_hl = malloc(row->hlspans * sizeof(struct hlSpan) + 1);
+    memcpy(saved_hl, row->hl, row->hlspans * sizeof(struct hlSpan));
+
+    unsigned char *hl = editorHlScratch(row->rsize + 1);
+    editorHlDecode(row, hl, 0, row->rsize);
+    memset(&hl[rx], HL_MATCH, qlen);
+    row->hlspans = 0;
+    editorHlSplice(row, hl, 0, row->rsize, 0);
 }
 
 void editorFind() {
@@ -729,6 +3935,12 @@ void editorFind() {
     int saved_coloff = E.coloff;
     int saved_rowoff = E.rowoff;
 
+    E.find.active = 1;
+    E.find.n = 0;
+    E.find.qlen = 0;
+    E.find.origin_line = E.cy;
+    E.find.origin_col = E.cx;
+
     char *query =
         editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
 
@@ -744,32 +3956,223 @@ void editorFind() {
 
 /*** append buffer ***/
 
-struct abuf {
-    char *b;
-    int len;
-};
-
-#define ABUF_INIT                                                              \
-    { NULL, 0 }
+void abReserve(struct abuf *ab, int len) {
+    if (ab->len + len <= ab->cap)
+        return;
+    int cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + len)
+        cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL)
+        die("realloc");
+    ab->b = new;
+    ab->cap = cap;
+}
 
 void abAppend(struct abuf *ab, const char *s, int len) {
-    char *new = realloc(ab->b, ab->len + len);
+    abReserve(ab, len);
+    memcpy(&ab->b[ab->len], s, len);
+    ab->len += len;
+}
 
-    if (new == NULL)
+void abReset(struct abuf *ab) { ab->len = 0; }
+
+void abFree(struct abuf *ab) {
+    free(ab->b);
+    ab->b = NULL;
+    ab->len = ab->cap = 0;
+}
+
+/*** screen buffer ***/
+
+void fbResize(int rows, int cols) {
+    free(E.fbfront);
+    free(E.fbback);
+    E.fbrows = rows;
+    E.fbcols = cols;
+    E.fbfront = malloc(sizeof(struct cell) * rows * cols);
+    E.fbback = malloc(sizeof(struct cell) * rows * cols);
+    E.fbfull = 1;
+}
+
+void fbPut(int y, int x, char ch, int fg, int attr) {
+    struct cell *c = &E.fbback[y * E.fbcols + x];
+    c->ch[0] = ch;
+    c->len = 1;
+    c->fg = fg;
+    c->attr = attr;
+}
+
+void fbPutGlyph(int y, int x, const char *s, int len, int width, int fg) {
+    struct cell *c = &E.fbback[y * E.fbcols + x];
+    memcpy(c->ch, s, len);
+    c->len = len;
+    c->fg = fg;
+    c->attr = 0;
+    if (width == 2) {
+        c[1].len = 0;
+        c[1].fg = fg;
+        c[1].attr = 0;
+    }
+}
+
+void fbCombine(int y, int x, const char *s, int len) {
+    struct cell *c = &E.fbback[y * E.fbcols + x];
+    if (c->len == 0 && x > 0)
+        c--;
+    if (c->len && c->len + len <= CELL_BYTES) {
+        memcpy(&c->ch[c->len], s, len);
+        c->len += len;
+    }
+}
+
+int fbText(int y, int x, const char *s, int len, int fg, int attr) {
+    int j;
+    for (j = 0; j < len && x < E.fbcols; j++)
+        fbPut(y, x++, s[j], fg, attr);
+    return x;
+}
+
+void fbClear(int y, int x) {
+    for (; x < E.fbcols; x++)
+        fbPut(y, x, ' ', 39, 0);
+}
+
+int fbIsBlank(struct cell *c) {
+    return c->len == 1 && c->ch[0] == ' ' && c->fg == 39 && c->attr == 0;
+}
+
+int fbSame(struct cell *a, struct cell *b) {
+    return a->len == b->len && a->fg == b->fg && a->attr == b->attr &&
+           !memcmp(a->ch, b->ch, a->len);
+}
+
+void fbInitSgr() {
+    int fg;
+    for (fg = 30; fg <= 39; fg++) {
+        E.sgrlen[SGR_FG][fg - 30] =
+            snprintf(E.sgr[SGR_FG][fg - 30], 12, "\x1b[%dm", fg);
+        E.sgrlen[SGR_PLAIN][fg - 30] =
+            snprintf(E.sgr[SGR_PLAIN][fg - 30], 12, "\x1b[27;%dm", fg);
+        E.sgrlen[SGR_REVERSE][fg - 30] =
+            snprintf(E.sgr[SGR_REVERSE][fg - 30], 12, "\x1b[7;%dm", fg);
+    }
+}
+
+void fbSetAttr(struct abuf *ab, struct cell *cur, struct cell *c) {
+    int mode;
+    if (cur->attr != c->attr)
+        mode = (c->attr & CELL_REVERSE) ? SGR_REVERSE : SGR_PLAIN;
+    else if (cur->fg != c->fg)
+        mode = SGR_FG;
+    else
         return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
+    abAppend(ab, E.sgr[mode][c->fg - 30], E.sgrlen[mode][c->fg - 30]);
+    cur->fg = c->fg;
+    cur->attr = c->attr;
 }
 
-void abFree(struct abuf *ab) { free(ab->b); }
+void fbEmit(struct abuf *ab, struct cell *cur, struct cell *c, int n) {
+    while (n > 0) {
+        int run = 1;
+        while (run < n && c[run].fg == c[0].fg && c[run].attr == c[0].attr)
+            run++;
+
+        fbSetAttr(ab, cur, c);
+        abReserve(ab, run * CELL_BYTES);
+        char *p = &ab->b[ab->len];
+        int j;
+        for (j = 0; j < run; j++) {
+            if (c[j].len == 1) {
+                *p++ = c[j].ch[0];
+            } else {
+                memcpy(p, c[j].ch, c[j].len);
+                p += c[j].len;
+            }
+        }
+        ab->len = p - ab->b;
+
+        c += run;
+        n -= run;
+    }
+}
+
+void fbFlush(struct abuf *ab) {
+    struct cell cur = {" ", 1, 39, 0};
+    int cy = -1, cx = -1;
+    int y, x;
+
+    if (E.fbfull) {
+        abAppend(ab, "\x1b[m\x1b[2J", 7);
+        for (x = 0; x < E.fbrows * E.fbcols; x++)
+            E.fbfront[x] = cur;
+        E.fbfull = 0;
+    }
+
+    for (y = 0; y < E.fbrows; y++) {
+        struct cell *back = &E.fbback[y * E.fbcols];
+        struct cell *front = &E.fbfront[y * E.fbcols];
+        int blank = E.fbcols;
+        while (blank > 0 && fbIsBlank(&back[blank - 1]))
+            blank--;
+
+        for (x = 0; x < E.fbcols; x++) {
+            if (fbSame(&back[x], &front[x]))
+                continue;
+            if (back[x].len == 0 && x > 0)
+                x--;
+
+            if (cy == y && cx >= 0 && cx < x && x - cx <= FB_GAP) {
+                fbEmit(ab, &cur, &back[cx], x - cx);
+                cx = x;
+            } else if (cy != y || cx != x) {
+                char buf[32];
+                int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1,
+                                   x + 1);
+                abAppend(ab, buf, len);
+                cy = y;
+                cx = x;
+            }
+
+            if (x >= blank) {
+                struct cell none = {" ", 1, 39, 0};
+                fbSetAttr(ab, &cur, &none);
+                abAppend(ab, "\x1b[K", 3);
+                for (; x < E.fbcols; x++)
+                    front[x] = none;
+                break;
+            }
+
+            int e = x + 1;
+            while (e < blank) {
+                int g = e;
+                while (g < blank && g - e < FB_GAP &&
+                       fbSame(&back[g], &front[g]))
+                    g++;
+                if (g == blank || fbSame(&back[g], &front[g]))
+                    break;
+                e = g + 1;
+            }
+            while (e < E.fbcols && back[e].len == 0)
+                e++;
+
+            fbEmit(ab, &cur, &back[x], e - x);
+            memcpy(&front[x], &back[x], sizeof(struct cell) * (e - x));
+            cx = e < E.fbcols ? e : -1;
+            x = e - 1;
+        }
+    }
+
+    if (cur.attr || cur.fg != 39)
+        abAppend(ab, "\x1b[m", 3);
+}
 
 /*** output ***/
 
 void editorScroll() {
     E.rx = E.cx;
     if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToCol(editorRowAt(E.cy), E.cx);
     }
 
     if (E.cy < E.rowoff) {
@@ -786,10 +4189,52 @@ void editorScroll() {
     }
 }
 
-void editorDrawRows(struct abuf *ab) {
+int editorDrawSpan(int y, int x, char *c, int len, int fg) {
+    int j = 0;
+    while (j < len) {
+        unsigned int cp = 0;
+        int n = 1, w = 1;
+        if (c[j] & 0x80) {
+            n = utf8Decode(&c[j], len - j, &cp);
+            if (n && cp >= 0xa0)
+                w = utf8Width(cp);
+        }
+        if (x >= E.screencols && w)
+            break;
+
+        if (iscntrl(c[j])) {
+            char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+            fbPut(y, x++, sym, 39, CELL_REVERSE);
+        } else if (!(c[j] & 0x80)) {
+            while (j + n < len && x + n < E.screencols && !(c[j + n] & 0x80) &&
+                   !iscntrl(c[j + n]))
+                n++;
+            x = fbText(y, x, &c[j], n, fg, 0);
+        } else if (n == 0 || cp < 0xa0) {
+            fbPut(y, x++, '?', 39, CELL_REVERSE);
+            n = n ? n : 1;
+        } else if (w == 0) {
+            if (x > 0)
+                fbCombine(y, x - 1, &c[j], n);
+        } else if (w == 2 && (x < 0 || x + 1 >= E.screencols)) {
+            fbPut(y, x < 0 ? 0 : x, ' ', fg, 0);
+            x += 2;
+        } else {
+            fbPutGlyph(y, x, &c[j], n, w, fg);
+            x += w;
+        }
+        j += n;
+    }
+    return x;
+}
+
+void editorDrawRows() {
+    editorHighlightRows(E.rowoff, E.rowoff + E.screenrows + HL_LOOKAHEAD);
+
     int y;
     for (y = 0; y < E.screenrows; y++) {
         int filerow = y + E.rowoff;
+        fbClear(y, 0);
         if (filerow >= E.numrows) {
             if (E.numrows == 0 && y == E.screenrows / 2) {
                 char welcome[80];
@@ -799,119 +4244,135 @@ void editorDrawRows(struct abuf *ab) {
                 if (welcomelen > E.screencols)
                     welcomelen = E.screencols;
                 int padding = (E.screencols - welcomelen) / 2;
-                if (padding) {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--)
-                    abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
+                if (padding)
+                    fbPut(y, 0, '~', 39, 0);
+                fbText(y, padding, welcome, welcomelen, 39, 0);
             } else {
-                abAppend(ab, "~", 1);
+                fbPut(y, 0, '~', 39, 0);
             }
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0)
-                len = 0;
-            if (len > E.screencols)
-                len = E.screencols;
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
-            int j;
-            for (j = 0; j < len; j++) {
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if (current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm",
-                                            current_color);
-                        abAppend(ab, buf, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        abAppend(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color) {
-                        current_color = color;
-                        char buf[16];
-                        int clen =
-                            snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
+            erow *row = editorRowAt(filerow);
+            int x;
+            int rx = editorRowColToRx(row, E.coloff, &x);
+            int k = editorHlSpanAt(row, rx);
+            x -= E.coloff;
+            while (rx < row->rsize && x < E.screencols) {
+                int stop = row->rsize;
+                int fg = 39;
+                if (k < row->hlspans && (int)row->hl[k].start <= rx) {
+                    stop = row->hl[k].start + row->hl[k].len;
+                    fg = editorSyntaxToColor(row->hl[k].hl);
+                    k++;
+                } else if (k < row->hlspans) {
+                    stop = row->hl[k].start;
                 }
+                x = editorDrawSpan(y, x, &row->render[rx], stop - rx, fg);
+                rx = stop;
             }
-            abAppend(ab, "\x1b[39m", 5);
         }
-
-        abAppend(ab, "\x1b[K", 3);
-        abAppend(ab, "\r\n", 2);
     }
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[7m", 4);
+void editorDrawStatusBar() {
+    int y = E.screenrows;
     char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+    int len = snprintf(status, sizeof(status), "%.20s - %d lines%s %s",
                        E.filename ? E.filename : "[No Name]", E.numrows,
+                       E.streamfd != -1   ? " (reading)"
+                       : E.follow         ? " (following)"
+                                          : "",
                        E.dirty ? "(modified)" : "");
-    int rlen =
-        snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-                 E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+    int rlen;
+    if (E.prof.overlay)
+        rlen = snprintf(rstatus, sizeof(rstatus),
+                        "p50/p99 %.2f/%.2fms %lu/%luB",
+                        profPercentile(PROF_FRAME, 50) / 1e6,
+                        profPercentile(PROF_FRAME, 99) / 1e6,
+                        profPercentile(PROF_BYTES, 50),
+                        profPercentile(PROF_BYTES, 99));
+    else if (E.find.active && E.find.qlen)
+        rlen = snprintf(rstatus, sizeof(rstatus), "match %d of %d%s",
+                        E.find.n ? E.find.cur + 1 : 0, E.find.n,
+                        E.find.truncated ? "+" : "");
+    else
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+                        E.syntax ? E.syntax->filetype : "no ft", E.cy + 1,
+                        E.numrows);
     if (len > E.screencols)
         len = E.screencols;
-    abAppend(ab, status, len);
+    fbText(y, 0, status, len, 39, CELL_REVERSE);
     while (len < E.screencols) {
         if (E.screencols - len == rlen) {
-            abAppend(ab, rstatus, rlen);
+            fbText(y, len, rstatus, rlen, 39, CELL_REVERSE);
             break;
         } else {
-            abAppend(ab, " ", 1);
-            len++;
+            fbPut(y, len++, ' ', 39, CELL_REVERSE);
         }
     }
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar() {
+    int y = E.screenrows + 1;
+    fbClear(y, 0);
     int msglen = strlen(E.statusmsg);
     if (msglen > E.screencols)
         msglen = E.screencols;
     if (msglen && time(NULL) - E.statusmsg_time < 5)
-        abAppend(ab, E.statusmsg, msglen);
+        fbText(y, 0, E.statusmsg, msglen, 39, 0);
+}
+
+void editorSetSize(int rows, int cols) {
+    E.screenrows = rows;
+    E.screencols = cols;
+    fbResize(rows, cols);
+    E.screenrows -= 2;
 }
 
 void editorRefreshScreen() {
+    if (E.resized) {
+        int rows, cols;
+        E.resized = 0;
+        if (getWindowSize(&rows, &cols) == -1)
+            die("getWindowSize");
+        editorSetSize(rows, cols);
+    }
+
+    E.redraw = 0;
+    long start = profBegin();
     editorScroll();
 
-    struct abuf ab = ABUF_INIT;
+    editorDrawRows();
+    editorDrawStatusBar();
+    editorDrawMessageBar();
+    profAdd(PROF_DRAW, start);
+
+    struct abuf *ab = &E.frame;
+    abReset(ab);
 
-    abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3);
+    abAppend(ab, "\x1b[?25l", 6);
+    start = profNow();
+    fbFlush(ab);
+    profAdd(PROF_FLUSH, start);
 
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    int cy = E.cy - E.rowoff;
+    int cx = E.rx - E.coloff;
+    if (ab->len == 6 && cy == E.fbcy && cx == E.fbcx) {
+        profFrame();
+        return;
+    }
+    E.fbcy = cy;
+    E.fbcx = cx;
 
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-             (E.rx - E.coloff) + 1);
-    abAppend(&ab, buf, strlen(buf));
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy + 1, cx + 1);
+    abAppend(ab, buf, len);
 
-    abAppend(&ab, "\x1b[?25h", 6);
+    abAppend(ab, "\x1b[?25h", 6);
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    start = profNow();
+    editorWrite(ab->b, ab->len);
+    profAdd(PROF_WRITE, start);
+    profFrame();
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -931,6 +4392,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
     size_t buflen = 0;
     buf[0] = '\0';
 
+    E.prompting++;
     while (1) {
         editorSetStatusMessage(prompt, buf);
         editorRefreshScreen();
@@ -944,12 +4406,14 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
             if (callback)
                 callback(buf, c);
             free(buf);
+            E.prompting--;
             return NULL;
         } else if (c == '\r') {
             if (buflen != 0) {
                 editorSetStatusMessage("");
                 if (callback)
                     callback(buf, c);
+                E.prompting--;
                 return buf;
             }
         } else if (!iscntrl(c) && c < 128) {
@@ -966,21 +4430,31 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
     }
 }
 
+void editorClampCursor() {
+    erow *row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
+    int rowlen = row ? row->size : 0;
+    if (E.cx > rowlen) {
+        E.cx = rowlen;
+    }
+    if (row)
+        E.cx = editorRowCharStart(row, E.cx);
+}
+
 void editorMoveCursor(int key) {
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
 
     switch (key) {
     case ARROW_LEFT:
         if (E.cx != 0) {
-            E.cx--;
+            E.cx = row ? editorRowCharStart(row, E.cx - 1) : 0;
         } else if (E.cy > 0) {
             E.cy--;
-            E.cx = E.row[E.cy].size;
+            E.cx = editorRowAt(E.cy)->size;
         }
         break;
     case ARROW_RIGHT:
         if (row && E.cx < row->size) {
-            E.cx++;
+            E.cx = editorRowCharEnd(row, E.cx);
         } else if (row && E.cx == row->size) {
             E.cy++;
             E.cx = 0;
@@ -998,18 +4472,54 @@ void editorMoveCursor(int key) {
         break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-    int rowlen = row ? row->size : 0;
-    if (E.cx > rowlen) {
-        E.cx = rowlen;
+    editorClampCursor();
+}
+
+void editorInsertKey(int c) {
+    unsigned char lead = c;
+    int len = 1;
+    if (lead >= 0xc2 && lead <= 0xf4)
+        len = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : 2;
+
+    editorInsertChar(c);
+    while (--len > 0) {
+        int b = editorReadByte(ESC_TIMEOUT);
+        if (b == -1)
+            break;
+        if ((b & 0xc0) != 0x80) {
+            E.inhead--;
+            break;
+        }
+        editorInsertChar(b);
     }
 }
 
+void editorPaste() {
+    size_t cap = 4096, len = 0;
+    char *buf = malloc(cap);
+    int c;
+
+    while ((c = editorReadByte(PASTE_TIMEOUT)) != -1) {
+        if (len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        buf[len++] = c;
+        if (c == '~' && len >= 6 && !memcmp(&buf[len - 6], "\x1b[201~", 6)) {
+            len -= 6;
+            break;
+        }
+    }
+    editorInsertText(buf, len);
+    free(buf);
+}
+
 void editorProcessKeypress() {
     static int quit_times = MARROW_QUIT_TIMES;
 
     int c = editorReadKey();
 
+    undoBegin();
     switch (c) {
     case '\r':
         editorInsertNewline();
@@ -1024,8 +4534,8 @@ void editorProcessKeypress() {
             return;
         }
 
-        write(STDOUT_FILENO, "\x1b[2J", 4);
-        write(STDOUT_FILENO, "\x1b[H", 3);
+        editorWrite("\x1b[2J", 4);
+        editorWrite("\x1b[H", 3);
         exit(0);
         break;
 
@@ -1033,22 +4543,39 @@ void editorProcessKeypress() {
         editorSave();
         break;
 
+    case DISK_CHANGED:
+        editorDiskEvent();
+        break;
+
+    case PASTE_START:
+        editorPaste();
+        break;
+
     case HOME_KEY:
         E.cx = 0;
         break;
 
     case END_KEY:
         if (E.cy < E.numrows)
-            E.cx = E.row[E.cy].size;
+            E.cx = editorRowAt(E.cy)->size;
         break;
 
     case CTRL_KEY('f'):
         editorFind();
         break;
 
+    case CTRL_KEY('z'):
+        editorUndo();
+        break;
+
+    case CTRL_KEY('y'):
+        editorRedo();
+        break;
+
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
+        E.undo.typing = 1;
         if (c == DEL_KEY)
             editorMoveCursor(ARROW_RIGHT);
         editorDelChar();
@@ -1063,6 +4590,7 @@ void editorProcessKeypress() {
             if (E.cy > E.numrows)
                 E.cy = E.numrows;
         }
+        editorClampCursor();
     } break;
 
     case ARROW_UP:
@@ -1073,13 +4601,23 @@ void editorProcessKeypress() {
         break;
 
     case CTRL_KEY('l'):
+        E.fbfull = 1;
+        break;
+
+    case CTRL_KEY('p'):
+        E.prof.overlay = !E.prof.overlay;
+        break;
+
     case '\x1b':
+    case PASTE_END:
         break;
 
     default:
-        editorInsertChar(c);
+        E.undo.typing = 1;
+        editorInsertKey(c);
         break;
     }
+    undoEnd();
 
     quit_times = MARROW_QUIT_TIMES;
 }
@@ -1087,38 +4625,123 @@ void editorProcessKeypress() {
 /*** init ***/
 
 void initEditor() {
+    E.infd = STDIN_FILENO;
+    E.outfd = STDOUT_FILENO;
+    E.recordfd = -1;
+    E.headless = 0;
+    E.outbytes = 0;
     E.cx = 0;
     E.cy = 0;
     E.rx = 0;
     E.rowoff = 0;
     E.coloff = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.rows = NULL;
+    E.map = NULL;
+    E.mapsize = 0;
+    E.mapcap = 0;
+    E.mapoff = NULL;
+    E.maplines = 0;
+    E.mapoffcap = 0;
+    E.streamfd = -1;
+    E.mapino = 0;
+    E.maptruncated = 0;
+    E.mapstale = 0;
+    E.pagesize = sysconf(_SC_PAGESIZE);
+    memset(&E.disk, 0, sizeof(E.disk));
+    E.diskchanged = 0;
+    E.prompting = 0;
+    E.follow = 0;
+    E.watchfd = -1;
+    E.watchwd = -1;
+    E.watchino = 0;
     E.dirty = 0;
     E.filename = NULL;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.syntax = NULL;
-
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1)
-        die("getWindowSize");
-    E.screenrows -= 2;
+    E.hlcheckcap = 64;
+    E.hlcheck = malloc(E.hlcheckcap);
+    E.hlcheck[0] = 0;
+    E.hlchecks = 1;
+    E.hlcheckn = 1;
+    E.hlcache_line = -1;
+    E.hlcache_state = 0;
+    E.hlversion = 0;
+    E.hlwait = 0;
+    E.hlhead = NULL;
+    E.hltail = NULL;
+    E.hlrows = 0;
+    memset(&E.find, 0, sizeof(E.find));
+    memset(&E.undo, 0, sizeof(E.undo));
+    undoClear();
+    memset(&E.slab, 0, sizeof(E.slab));
+    memset(&E.prof, 0, sizeof(E.prof));
+    E.fbfront = NULL;
+    E.fbback = NULL;
+    E.fbcx = E.fbcy = -1;
+    E.inhead = E.intail = 0;
+    if (pipe(E.winchpipe) == -1)
+        die("pipe");
+    fcntl(E.winchpipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(E.winchpipe[1], F_SETFL, O_NONBLOCK);
+    E.frame.b = NULL;
+    E.frame.len = E.frame.cap = 0;
+    fbInitSgr();
+    E.resized = 0;
+    E.redraw = 0;
+
+    pthread_mutex_init(&E.lock, NULL);
+    pthread_cond_init(&E.hlcond, NULL);
+    pthread_mutex_lock(&E.lock);
+    if (pthread_create(&E.hlworker, NULL, editorSyntaxWorker, NULL) != 0)
+        die("pthread_create");
 }
 
+#ifndef MARROW_BENCH
 int main(int argc, char *argv[]) {
-    enableRawMode();
+    int rows, cols;
+    int follow = argc >= 3 && !strcmp(argv[1], "-f");
+    char *path = follow ? argv[2] : argc >= 2 ? argv[1] : NULL;
+
     initEditor();
-    if (argc >= 2) {
-        if (access(argv[1], F_OK) != 0) {
+    if (!isatty(STDIN_FILENO) && (!path || !strcmp(path, "-")))
+        editorStreamOpen();
+    enableRawMode();
+    if (getWindowSize(&rows, &cols) == -1)
+        die("getWindowSize");
+    editorSetSize(rows, cols);
+    signal(SIGWINCH, editorHandleWinch);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = editorHandleBus;
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGBUS, &sa, NULL);
+
+    char *record = getenv("MARROW_RECORD");
+    if (record) {
+        E.recordfd = open(record, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (E.recordfd == -1)
+            die("open");
+    }
+    E.prof.dump = getenv("MARROW_PROFILE");
+    if (E.prof.dump)
+        atexit(profDump);
+
+    if (path && strcmp(path, "-") != 0) {
+        if (access(path, F_OK) != 0) {
             // Create file
-            FILE *fptr = fopen(argv[1], "w");
+            FILE *fptr = fopen(path, "w");
             fclose(fptr);
         }
-        editorOpen(argv[1]);
+        editorOpen(path);
+        E.follow = follow;
+        editorWatchStart();
     }
 
     editorSetStatusMessage(
-        "HElP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+        "HElP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-Z = undo");
 
     while (1) {
         editorRefreshScreen();
@@ -1127,3 +4750,310 @@ int main(int argc, char *argv[]) {
 
     return 0;
 }
+#endif
+
+/*** bench ***/
+
+#ifdef MARROW_BENCH
+struct benchSample {
+    long ns;
+    long bytes;
+    long allocs;
+};
+
+struct benchState {
+    const char *name;
+    struct benchSample *s;
+    int n;
+    int cap;
+    int started;
+    long last;
+    size_t lastbytes;
+    long lastallocs;
+    long allocs;
+    double openms;
+    char dir[64];
+};
+
+struct benchState B;
+
+void *benchMalloc(size_t size) {
+    B.allocs++;
+    return (malloc)(size);
+}
+
+void *benchCalloc(size_t n, size_t size) {
+    B.allocs++;
+    return (calloc)(n, size);
+}
+
+void *benchRealloc(void *p, size_t size) {
+    B.allocs++;
+    return (realloc)(p, size);
+}
+
+void benchKey() {
+    long now = profNow();
+    if (B.started) {
+        if (B.n == B.cap) {
+            B.cap = B.cap ? B.cap * 2 : 1024;
+            B.s = (realloc)(B.s, sizeof(struct benchSample) * B.cap);
+        }
+        B.s[B.n].ns = now - B.last;
+        B.s[B.n].bytes = E.outbytes - B.lastbytes;
+        B.s[B.n].allocs = B.allocs - B.lastallocs;
+        B.n++;
+    }
+    B.started = 1;
+    B.lastbytes = E.outbytes;
+    B.lastallocs = B.allocs;
+    B.last = profNow();
+}
+
+int benchCmpNs(const void *a, const void *b) {
+    long x = ((const struct benchSample *)a)->ns;
+    long y = ((const struct benchSample *)b)->ns;
+    return (x > y) - (x < y);
+}
+
+int benchCmpBytes(const void *a, const void *b) {
+    long x = ((const struct benchSample *)a)->bytes;
+    long y = ((const struct benchSample *)b)->bytes;
+    return (x > y) - (x < y);
+}
+
+struct benchSample *benchPct(int pct) {
+    return &B.s[(long)(B.n - 1) * pct / 100];
+}
+
+void benchReport() {
+    long allocs = 0, bytes = 0;
+    int j;
+
+    if (B.n == 0) {
+        printf("%-10s no keys replayed\n", B.name);
+        return;
+    }
+    for (j = 0; j < B.n; j++) {
+        allocs += B.s[j].allocs;
+        bytes += B.s[j].bytes;
+    }
+
+    qsort(B.s, B.n, sizeof(struct benchSample), benchCmpNs);
+    printf("%-10s %7d %8.1f %8.1f %8.1f %8.1f %9.1f", B.name, B.n, B.openms,
+           benchPct(50)->ns / 1e3, benchPct(99)->ns / 1e3,
+           B.s[B.n - 1].ns / 1e3, (double)allocs / B.n);
+    qsort(B.s, B.n, sizeof(struct benchSample), benchCmpBytes);
+    printf(" %9.1f %9ld %9ld\n", (double)bytes / B.n, benchPct(99)->bytes,
+           B.s[B.n - 1].bytes);
+}
+
+void benchRun(const char *name, char *file, char *script) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+
+    if (pid == 0) {
+        initEditor();
+        E.headless = 1;
+        E.infd = open(script, O_RDONLY);
+        E.outfd = open("/dev/null", O_WRONLY);
+        if (E.infd == -1 || E.outfd == -1)
+            die("open");
+        editorSetSize(BENCH_ROWS, BENCH_COLS);
+
+        B.name = name;
+        long start = profNow();
+        editorOpen(file);
+        B.openms = (profNow() - start) / 1e6;
+        B.allocs = 0;
+        atexit(benchReport);
+
+        editorSetStatusMessage(
+            "HElP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-Z = undo");
+        while (1) {
+            editorRefreshScreen();
+            editorProcessKeypress();
+        }
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        printf("%-10s failed\n", name);
+}
+
+char *benchPath(const char *name) {
+    static char path[4][128];
+    static int k;
+    k = (k + 1) % 4;
+    snprintf(path[k], sizeof(path[k]), "%s/%s", B.dir, name);
+    return path[k];
+}
+
+void benchWrite(const char *name, struct abuf *ab) {
+    int fd = open(benchPath(name), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || write(fd, ab->b, ab->len) != ab->len) {
+        perror(benchPath(name));
+        exit(1);
+    }
+    close(fd);
+    abReset(ab);
+}
+
+void benchRepeat(struct abuf *ab, const char *s, int times) {
+    int len = strlen(s);
+    while (times-- > 0)
+        abAppend(ab, s, len);
+}
+
+void benchGenerate() {
+    struct abuf ab = ABUF_INIT;
+    char line[160];
+    int j;
+
+    for (j = 0; j < 200000; j++) {
+        int len;
+        switch (j % 8) {
+        case 0:
+            len = snprintf(line, sizeof(line),
+                           "/* block %d: generated for the benchmark\n", j);
+            break;
+        case 1:
+            len = snprintf(line, sizeof(line), " * spans two lines */\n");
+            break;
+        case 2:
+            len = snprintf(line, sizeof(line),
+                           "int func%d(int a, char *s) {\n", j);
+            break;
+        case 3:
+            len = snprintf(line, sizeof(line),
+                           "\tif (a > %d) // bump and return\n", j);
+            break;
+        case 4:
+            len = snprintf(line, sizeof(line), "\t\treturn a * 2 + 0x%x;\n", j);
+            break;
+        case 5:
+            len = snprintf(line, sizeof(line),
+                           "\twhile (*s) s++; /* walk */\n");
+            break;
+        case 6:
+            len = snprintf(line, sizeof(line),
+                           "\treturn strlen(\"value %d\\t\");\n}\n", j);
+            break;
+        default:
+            len = snprintf(line, sizeof(line), "\n");
+            break;
+        }
+        abAppend(&ab, line, len);
+    }
+    benchWrite("big.c", &ab);
+
+    benchRepeat(&ab, "\tab cd", 200000);
+    abAppend(&ab, "\n", 1);
+    benchWrite("long.txt", &ab);
+
+    for (j = 0; j < 50000; j++) {
+        int len = snprintf(line, sizeof(line),
+                           "%d: na\xc3\xafve caf\xc3\xa9 \xe2\x80\x94 "
+                           "\xe6\x9d\xb1\xe4\xba\xac \xe6\x97\xa5\xe6\x9c\xac "
+                           "e\xcc\x81 \xf0\x9f\x99\x82\n",
+                           j);
+        abAppend(&ab, line, len);
+    }
+    benchWrite("utf8.txt", &ab);
+
+    /* Jump to the middle of a large C file and type there. */
+    benchRepeat(&ab, "\x06func100002(\r", 1);
+    for (j = 0; j < 100; j++)
+        benchRepeat(&ab, "\tif (x > 1) return y; /* typed */ \"str\" 42\r", 1);
+    benchWrite("type.keys", &ab);
+
+    benchRepeat(&ab, "\x1b[B", 20000);
+    benchRepeat(&ab, "\x1b[A", 5000);
+    benchWrite("scroll.keys", &ab);
+
+    /* Open and close a comment at the top, forcing re-highlighting. */
+    benchRepeat(&ab, "/*", 1);
+    benchRepeat(&ab, "\x1b[B", 3000);
+    benchRepeat(&ab, "\x1b[A", 3000);
+    benchRepeat(&ab, "\x1b[H\x1b[3~\x1b[3~", 1);
+    benchRepeat(&ab, "\x1b[B", 3000);
+    benchWrite("comment.keys", &ab);
+
+    benchRepeat(&ab, "\x06strlen", 1);
+    benchRepeat(&ab, "\x1b[B", 300);
+    benchRepeat(&ab, "\r\x06func1999\r", 1);
+    benchWrite("find.keys", &ab);
+
+    benchRepeat(&ab, "\x1b[F", 1);
+    benchRepeat(&ab, "\x1b[D", 300);
+    benchRepeat(&ab, "x", 300);
+    benchRepeat(&ab, "\x7f", 300);
+    benchWrite("long.keys", &ab);
+
+    for (j = 0; j < 300; j++)
+        benchRepeat(&ab, "\x1b[B\x1b[F\x1b[D\x1b[D\xe5\xad\x97\x7f", 1);
+    benchRepeat(&ab, "\x1b[B", 3000);
+    benchWrite("utf8.keys", &ab);
+
+    benchRepeat(&ab, "\x06func100002(\r\x1b[200~", 1);
+    benchRepeat(&ab, "\tint pasted = 1; /* from the clipboard */\n", 20000);
+    benchRepeat(&ab, "\x1b[201~", 1);
+    benchRepeat(&ab, "\x1b[B", 3000);
+    benchWrite("paste.keys", &ab);
+
+    abFree(&ab);
+}
+
+int main(int argc, char *argv[]) {
+    static const char *runs[][3] = {
+        {"type", "big.c", "type.keys"},
+        {"scroll", "big.c", "scroll.keys"},
+        {"comment", "big.c", "comment.keys"},
+        {"find", "big.c", "find.keys"},
+        {"paste", "big.c", "paste.keys"},
+        {"longline", "long.txt", "long.keys"},
+        {"utf8", "utf8.txt", "utf8.keys"},
+    };
+    const char *files[] = {"big.c",     "long.txt",  "utf8.txt",
+                           "type.keys", "scroll.keys", "comment.keys",
+                           "find.keys", "long.keys", "utf8.keys",
+                           "paste.keys"};
+    unsigned int j;
+
+    if (argc > 1 && argc < 3) {
+        fprintf(stderr, "usage: %s [file script...]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-10s %7s %8s %8s %8s %8s %9s %9s %9s %9s\n", "script", "keys",
+           "open ms", "p50 us", "p99 us", "max us", "allocs/k", "bytes/f",
+           "p99 B/f", "max B/f");
+
+    if (argc >= 3) {
+        int k;
+        for (k = 2; k < argc; k++)
+            benchRun(argv[k], argv[1], argv[k]);
+        return 0;
+    }
+
+    strcpy(B.dir, "/tmp/marrow-bench.XXXXXX");
+    if (mkdtemp(B.dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    benchGenerate();
+
+    for (j = 0; j < sizeof(runs) / sizeof(runs[0]); j++)
+        benchRun(runs[j][0], benchPath(runs[j][1]), benchPath(runs[j][2]));
+
+    for (j = 0; j < sizeof(files) / sizeof(files[0]); j++)
+        unlink(benchPath(files[j]));
+    rmdir(B.dir);
+    return 0;
+}
+#endif